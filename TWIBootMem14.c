@@ -0,0 +1,190 @@
+// TWI bootloader speaking the TWISlaveMem14.c protocol; see TWIBootMem14.h for
+// the register map and TWIBootUpload.h for the master side.
+//
+// It polls TWINT rather than using interrupts, so nothing needs to be moved to
+// the boot section's vector table. Link it into the boot section and program
+// BOOTRST, e.g. for an ATmega2560 with a 4K word boot section:
+//   -Wl,--section-start=.text=0x3E000
+// (see example/twi_bootloader). With -DBOOT_NO_MAIN there is no main(), and
+// boot_init() and boot_twi() are driven from outside, as example/host_sim's
+// boot_test does.
+
+#include <stdint.h>
+#include <avr/io.h>
+#include <avr/boot.h>
+#include <avr/pgmspace.h>
+#include <util/twi.h>
+#include "TWICrc8.h"
+#include "TWIBootMem14.h"
+
+#ifndef BOOT_TWI_ADDRESS
+#define BOOT_TWI_ADDRESS 0x50
+#endif
+
+// first byte of the boot section; pages at or above this are refused
+#ifndef BOOT_START
+#define BOOT_START (FLASHEND + 1UL - 0x2000UL)
+#endif
+
+// number of idle polls of TWINT before the application is started, unless a
+// master has addressed us in the meantime (roughly a second at 16 MHz)
+#ifndef BOOT_WAIT
+#define BOOT_WAIT 0x100000UL
+#endif
+
+// jumps to the application's reset vector; the host simulator
+// (example/host_sim) has its own
+#ifndef BOOT_APP
+#define BOOT_APP() ((void (*)(void))0)()
+#endif
+
+/* TWI init_ support functions.
+*/
+static inline void init_clear_bus_error() {
+  TWCR = (1<<TWEN)|                                 // TWI Interface enabled
+         (0<<TWIE)|(1<<TWINT)|                      // No interrupt; we poll TWINT
+         (1<<TWEA)|(0<<TWSTA)|(1<<TWSTO)|           // Send ACK after reception
+         (0<<TWWC);
+}
+
+static inline void init_ack() {
+  TWCR = (1<<TWEN)|                                 // TWI Interface enabled
+         (0<<TWIE)|(1<<TWINT)|                      // No interrupt; we poll TWINT
+         (1<<TWEA)|(0<<TWSTA)|(0<<TWSTO)|           // Send ACK after reception
+         (0<<TWWC);
+}
+
+static uint8_t page[SPM_PAGESIZE];
+static uint8_t ctrl[BOOT_CTRL_LEN];
+
+static int16_t i;
+static union {
+  uint8_t c[2];
+  uint16_t i;
+} a;
+
+static void start_app() {
+  TWCR = 0;
+  BOOT_APP();
+}
+
+static uint8_t *reg(uint16_t i) {
+  if (i < SPM_PAGESIZE)
+    return &page[i];
+  if (i >= BOOT_CTRL && i < BOOT_CTRL + BOOT_CTRL_LEN)
+    return &ctrl[i - BOOT_CTRL];
+  return 0;
+}
+
+static uint8_t program_page() {
+  uint16_t n = ctrl[BOOT_PAGE] | (ctrl[BOOT_PAGE+1] << 8);
+  uint32_t a = (uint32_t)n * SPM_PAGESIZE;
+  uint8_t crc = 0;
+  uint16_t k;
+
+  for (k = 0; k < SPM_PAGESIZE; k++)
+    crc = crc8(crc, page[k]);
+
+  if (crc != ctrl[BOOT_CRC])
+    return BOOT_BAD_CRC;
+  if (a >= BOOT_START)
+    return BOOT_BAD_PAGE;
+
+  boot_page_erase(a);
+  boot_spm_busy_wait();
+
+  for (k = 0; k < SPM_PAGESIZE; k += 2)
+    boot_page_fill(a + k, page[k] | (page[k+1] << 8));
+
+  boot_page_write(a);
+  boot_spm_busy_wait();
+  boot_rww_enable();
+
+  return BOOT_OK;
+}
+
+void boot_init(void) {
+  ctrl[BOOT_PAGESIZE]   = SPM_PAGESIZE & 0xFF;
+  ctrl[BOOT_PAGESIZE+1] = SPM_PAGESIZE >> 8;
+
+  TWAR = BOOT_TWI_ADDRESS << 1;
+  init_ack();
+}
+
+// The state machine: handles the TWI event that set TWINT. Returns 1 if a
+// master addressed us. main() polls for the events; the host simulator calls
+// this as its bus delivers them.
+uint8_t boot_twi(void) {
+  uint8_t *p;
+
+  switch (TWSR & 0xF8) {
+    // we just ACKed our address; the next two bytes are the Mem14 address
+    case TW_SR_SLA_ACK:
+      i = -2;
+      init_ack();
+      return 1;
+
+    case TW_SR_DATA_ACK:
+      if (i < 0) {
+        a.c[i++ + 2] = TWDR;
+        if (0 == i)
+          i = a.i & 0x3fff;
+      } else if ((p = reg(i++)) != 0) {
+        *p = TWDR;
+        // a new page write; the status of the last one must not be taken
+        // for its own
+        if (p == &ctrl[BOOT_CMD] && *p == BOOT_CMD_WRITE)
+          ctrl[BOOT_STATUS] = BOOT_BUSY;
+      }
+      init_ack();
+      break;
+
+    case TW_ST_SLA_ACK:
+    case TW_ST_DATA_ACK:
+      TWDR = (i >= 0 && (p = reg(i++)) != 0) ? *p : 0;
+      init_ack();
+      return 1;
+
+    // a STOP or repeated START; run any pending command
+    case TW_SR_STOP:
+      if (ctrl[BOOT_CMD] == BOOT_CMD_WRITE) {
+        ctrl[BOOT_CMD] = 0;
+        TWCR = 0; // don't answer our address while programming
+        ctrl[BOOT_STATUS] = program_page();
+      } else if (ctrl[BOOT_CMD] == BOOT_CMD_EXIT)
+        start_app();
+      init_ack();
+      break;
+
+    case TW_BUS_ERROR:
+      init_clear_bus_error();
+      break;
+
+    // unlike TWISlaveMem14.c we always go back to ACKing our address, as
+    // there is no application to recover us
+    default:
+      init_ack();
+      break;
+  }
+
+  return 0;
+}
+
+#ifndef BOOT_NO_MAIN
+int main(void) {
+  uint32_t wait = BOOT_WAIT;
+
+  boot_init();
+
+  for (;;) {
+    if (!(TWCR & (1<<TWINT))) {
+      if (wait && --wait == 0)
+        start_app();
+      continue;
+    }
+
+    if (boot_twi())
+      wait = 0; // a master is talking to us; stay in the bootloader
+  }
+}
+#endif
@@ -0,0 +1,34 @@
+#ifndef TWIBootMem14_h
+#define TWIBootMem14_h
+
+/* Register map of TWIBootMem14.c, shared with the master side in TWIBootUpload.h.
+
+   The bootloader speaks the TWISlaveMem14.c protocol (2-byte address, LSB
+   first, then data) without groups. The page buffer is at Mem14 address 0 and
+   the control registers at BOOT_CTRL. Writing BOOT_CMD_WRITE to BOOT_CMD
+   programs the buffer into the given page at the next STOP; the bootloader
+   does not answer its address while programming, so the master ACK-polls.
+*/
+
+#define BOOT_CTRL 0x3F00
+
+// offsets from BOOT_CTRL
+#define BOOT_PAGE      0 // (w) 2 bytes, page number, LSB first
+#define BOOT_CRC       2 // (w) CRC-8 (see TWICrc8.h) of the whole page buffer
+#define BOOT_CMD       3 // (w) command, executed at the following STOP
+#define BOOT_STATUS    4 // (r) result of the last command, BOOT_BUSY until it is done
+#define BOOT_PAGESIZE  5 // (r) 2 bytes, SPM page size in bytes, LSB first
+#define BOOT_CTRL_LEN  7
+
+// commands
+#define BOOT_CMD_WRITE 'W'
+#define BOOT_CMD_EXIT  'X' // start the application
+
+// status
+#define BOOT_OK        0
+#define BOOT_BAD_CRC   1
+#define BOOT_BAD_PAGE  2 // page is outside the application section
+#define BOOT_BUSY      3 // a command was written and has not finished yet
+#define BOOT_NO_ANSWER 0xFF // only returned by the master side
+
+#endif // #ifndef TWIBootMem14_h
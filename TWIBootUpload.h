@@ -0,0 +1,90 @@
+#ifndef TWIBootUpload_H
+#define TWIBootUpload_H
+
+#include "TWIMaster.h"
+#include "TWIHelper.h"
+#include "TWICrc8.h"
+#include "TWIBootMem14.h"
+
+/* Master side of TWIBootMem14.c: streams flash pages to a node running the
+   bootloader. A whole image is sent by calling twi_boot_write_page(...) for
+   every page and then twi_boot_exit(...).
+*/
+
+#define BOOT_CHUNK 32       // page bytes per TWI write; must divide the page size
+#define BOOT_MAXPAGE 256    // largest SPM page size we can stage
+#define BOOT_POLLS 2000     // ACK-polls while a page is being programmed
+
+static volatile bool _boot_chunk_failed;
+
+static void boot_chunk_done(state_t *s) {
+  if (!(s->state & (1<<STATE_SUCCESS_BIT)))
+    _boot_chunk_failed = true;
+}
+
+// returns the bootloader's SPM page size, or 0 if it did not answer
+uint16_t twi_boot_pagesize(uint8_t twi_addr) {
+  char c[BOOT_CTRL_LEN];
+
+  if (!twi_mem14_read(twi_addr, BOOT_CTRL, c, sizeof(c)))
+    return 0;
+
+  return (uint8_t)c[BOOT_PAGESIZE] | ((uint8_t)c[BOOT_PAGESIZE+1] << 8);
+}
+
+// Programs one page of pagesize bytes (from twi_boot_pagesize(...)). The chunks
+// are enqueued back-to-back without waiting for each other; then the page
+// number, CRC and command are written and the node is ACK-polled until it has
+// finished programming. Returns the bootloader's status, BOOT_OK on success.
+uint8_t twi_boot_write_page(uint8_t twi_addr, uint16_t page, const char *data, uint16_t pagesize) {
+  char stage[BOOT_MAXPAGE / BOOT_CHUNK][2 + BOOT_CHUNK];
+  uint8_t crc = 0;
+
+  if (pagesize > BOOT_MAXPAGE)
+    return BOOT_BAD_PAGE;
+
+  _boot_chunk_failed = false;
+
+  for (uint16_t a = 0; a < pagesize; a += BOOT_CHUNK) {
+    char *p = stage[a / BOOT_CHUNK];
+
+    p[0] = (char)(a & 0xFF);
+    p[1] = (char)(a >> 8);
+    for (uint8_t k = 0; k < BOOT_CHUNK; k++) {
+      p[2 + k] = data[a + k];
+      crc = crc8(crc, data[a + k]);
+    }
+
+    // the queue may be full of our own chunks; with polled callbacks, slots
+    // are only freed by run_callbacks()
+    while (!twiQ.enqueue_w(twi_addr, p, 2 + BOOT_CHUNK, boot_chunk_done))
+      twiQ.run_callbacks();
+  }
+
+  // commands complete in order, so the chunks are done when this returns
+  char c[] = { (char)(BOOT_CTRL & 0xFF), (char)(BOOT_CTRL >> 8),
+               (char)(page & 0xFF), (char)(page >> 8), (char)crc, BOOT_CMD_WRITE };
+
+  if (!twiQ.enqueue_wb(twi_addr, c, sizeof(c), NULL) || _boot_chunk_failed)
+    return BOOT_NO_ANSWER;
+
+  // the bootloader NACKs its address until the page is written, and reads
+  // BOOT_BUSY until it has started on it
+  for (uint16_t n = 0; n < BOOT_POLLS; n++) {
+    char s;
+
+    if (twi_mem14_read(twi_addr, BOOT_CTRL + BOOT_STATUS, &s, 1) && s != BOOT_BUSY)
+      return s;
+  }
+
+  return BOOT_NO_ANSWER;
+}
+
+// starts the application on the node
+bool twi_boot_exit(uint8_t twi_addr) {
+  char c[] = { (char)((BOOT_CTRL + BOOT_CMD) & 0xFF), (char)((BOOT_CTRL + BOOT_CMD) >> 8), BOOT_CMD_EXIT };
+
+  return twiQ.enqueue_wb(twi_addr, c, sizeof(c), NULL);
+}
+
+#endif
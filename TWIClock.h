@@ -0,0 +1,58 @@
+#ifndef TWIClock_h
+#define TWIClock_h
+
+#include <stdint.h>
+
+/* Compile-time TWI bit rate calculation (needs -std=gnu++11 for constexpr).
+
+   From the datasheet: SCL frequency = F_CPU / (16 + 2 * TWBR * 4^TWPS). The
+   prescaler is the smallest that gets TWBR <= 255, and TWBR is rounded up, so
+   that SCL is never faster than asked for.
+
+   Usage:
+     static_assert(twi_scl_ok(F_CPU, 400000UL, 10), "can't get within 10% of 400kHz");
+     TWBR = twi_twbr(F_CPU, 400000UL);
+*/
+
+// 4^twps
+constexpr uint32_t twi_ps_div(uint8_t twps) {
+  return (uint32_t)1 << (2 * twps);
+}
+
+// TWBR for a given TWPS, rounded up; 0 if f_cpu is too slow for scl at all
+constexpr uint32_t twi_twbr_ps(uint32_t f_cpu, uint32_t scl, uint8_t twps) {
+  return f_cpu <= 16 * scl
+    ? 0
+    : (f_cpu - 16 * scl + 2 * twi_ps_div(twps) * scl - 1) / (2 * twi_ps_div(twps) * scl);
+}
+
+// the smallest TWPS whose TWBR fits in 8 bits (4 if none does)
+constexpr uint8_t twi_twps(uint32_t f_cpu, uint32_t scl, uint8_t twps = 0) {
+  return twps > 3 || twi_twbr_ps(f_cpu, scl, twps) <= 255
+    ? twps
+    : twi_twps(f_cpu, scl, twps + 1);
+}
+
+constexpr uint8_t twi_twbr(uint32_t f_cpu, uint32_t scl) {
+  return (uint8_t)twi_twbr_ps(f_cpu, scl, twi_twps(f_cpu, scl));
+}
+
+// the SCL frequency that twbr and twps actually give
+constexpr uint32_t twi_scl(uint32_t f_cpu, uint8_t twbr, uint8_t twps) {
+  return f_cpu / (16 + 2 * twbr * twi_ps_div(twps));
+}
+
+// CPU clocks in one SCL clock
+constexpr uint32_t twi_scl_cycles(uint8_t twbr, uint8_t twps) {
+  return 16 + 2 * twbr * twi_ps_div(twps);
+}
+
+// true if scl can be met to within tolerance percent (it is never exceeded)
+constexpr bool twi_scl_ok(uint32_t f_cpu, uint32_t scl, uint8_t tolerance) {
+  return twi_twps(f_cpu, scl) <= 3 &&
+         f_cpu >= 16 * scl &&
+         (uint64_t)twi_scl(f_cpu, twi_twbr(f_cpu, scl), twi_twps(f_cpu, scl)) * 100 >=
+         (uint64_t)scl * (100 - tolerance);
+}
+
+#endif // #ifndef TWIClock_h
@@ -5,6 +5,15 @@
 #include <stddef.h>
 
 #define I2C_WHO_ADDRESS 0
+#define I2C_GENERAL_CALL_ADDRESS 0
+#define TWI_GCALL_LATCH 0x4C // must match TWISlaveMem14.c
+#define TWI_MEM14_MAXBLOCKS 32
+
+// automatic address assignment; must match TWISlaveMem14.c
+#define TWI_UID_LEN 4
+#define TWI_ARP_ADDRESS 0x61
+#define TWI_GCALL_ARP_PREFIX 0x4E
+#define TWI_GCALL_ARP_ASSIGN 0x50
 
 uint8_t twi_who(uint8_t twi_addr) {
   char p[1] = { I2C_WHO_ADDRESS };
@@ -16,7 +25,7 @@ uint8_t twi_who(uint8_t twi_addr) {
 }
 
 uint8_t twi_read8(uint8_t twi_addr, uint8_t mem_addr) {
-  char p[] = { mem_addr };
+  char p[] = { (char)mem_addr };
   return twiQ.enqueue_wb(twi_addr, p, sizeof(p), NULL) &&
          twiQ.enqueue_rb(twi_addr, p, sizeof(p), NULL)
     ? p[0]
@@ -24,9 +33,187 @@ uint8_t twi_read8(uint8_t twi_addr, uint8_t mem_addr) {
 }
 
 void twi_write8(uint8_t twi_addr, uint8_t mem_addr, uint8_t value) {
-  char p[] = { mem_addr, value };
+  char p[] = { (char)mem_addr, (char)value };
   
   twiQ.enqueue_wb(twi_addr, p, sizeof(p), NULL);
 }
 
-#endif
\ No newline at end of file
+#ifdef USINGINLINE
+// fire-and-forget version of twi_write8; returns false if the queue is full
+bool twi_write8_async(uint8_t twi_addr, uint8_t mem_addr, uint8_t value) {
+  char p[] = { (char)mem_addr, (char)value };
+
+  return twiQ.enqueue_w_inline(twi_addr, p, sizeof(p), NULL);
+}
+#endif
+
+// SMBus quick command: just the address with rw as the R/W bit. Returns true if
+// the device ACKed.
+bool twi_quick(uint8_t twi_addr, uint8_t rw) {
+  return rw
+    ? twiQ.enqueue_rb(twi_addr, NULL, 0, NULL, (1<<FLAG_QUICK_BIT))
+    : twiQ.enqueue_wb(twi_addr, NULL, 0, NULL, (1<<FLAG_QUICK_BIT));
+}
+
+static volatile bool _block_cmd_failed;
+
+static void block_cmd_done(state_t *s) {
+  if (!(s->state & (1<<STATE_SUCCESS_BIT)))
+    _block_cmd_failed = true;
+}
+
+// SMBus block read of command cmd into p, of size len: p[0] is the count sent
+// by the device, and at most len - 1 bytes follow it. Returns the number of
+// bytes read after p[0] (up to 255), or -1 on error.
+int16_t twi_block_read(uint8_t twi_addr, uint8_t cmd, char *p, twi_len_t len) {
+  char c[] = { (char)cmd };
+  uint8_t sreg = SREG;
+
+  // The command is enqueued without waiting for it, and the read straight
+  // after it with interrupts still off, so that the read follows it with a
+  // repeated START rather than a STOP. c outlives both, as the read blocks.
+  _block_cmd_failed = false;
+  cli();
+  while (!twiQ.enqueue_w(twi_addr, c, sizeof(c), block_cmd_done)) {
+    sei();
+    // with polled callbacks, slots are only freed here
+    twiQ.run_callbacks();
+    cli();
+  }
+  bool ok = twiQ.enqueue_rb(twi_addr, p, len, NULL, (1<<FLAG_BLOCK_BIT));
+  SREG = sreg;
+
+  if (!ok || _block_cmd_failed)
+    return -1;
+
+  return (uint8_t)p[0] < len - 1 ? (uint8_t)p[0] : len - 1;
+}
+
+// reads len bytes at mem_addr of a TWISlaveMem14 node
+bool twi_mem14_read(uint8_t twi_addr, uint16_t mem_addr, char *p, uint8_t len) {
+  char a[] = { (char)(mem_addr & 0xFF), (char)(mem_addr >> 8) };
+
+  return twiQ.enqueue_wb(twi_addr, a, sizeof(a), NULL) &&
+         twiQ.enqueue_rb(twi_addr, p, len, NULL);
+}
+
+// Brings mirror, a local copy of a TWISlaveMem14 node's register file, up to
+// date using the change counters kept by the node's store_write(...): reads the
+// nblocks counters at gen_addr, then only the blocks of 2^shift bytes whose
+// counter differs from the copy in mirror. A block whose counter is still 0
+// matches a zeroed mirror, so make the first sync with all set, which reads
+// every block. Returns the number of blocks read, or -1 on a TWI error.
+int8_t twi_mem14_sync(uint8_t twi_addr, char *mirror, uint16_t gen_addr, uint8_t nblocks, uint8_t shift, bool all = false) {
+  char gen[TWI_MEM14_MAXBLOCKS];
+  int8_t count = 0;
+
+  if (nblocks > TWI_MEM14_MAXBLOCKS ||
+      !twi_mem14_read(twi_addr, gen_addr, gen, nblocks))
+    return -1;
+
+  // compare everything first, as the counters may be inside one of the blocks
+  uint32_t changed = 0;
+  for (uint8_t b = 0; b < nblocks; b++)
+    if (all || gen[b] != mirror[gen_addr + b])
+      changed |= (uint32_t)1 << b;
+
+  for (uint8_t b = 0; b < nblocks; b++) {
+    if (!(changed & ((uint32_t)1 << b)))
+      continue;
+
+    uint16_t a = (uint16_t)b << shift;
+    if (!twi_mem14_read(twi_addr, a, &mirror[a], 1 << shift))
+      return -1;
+    count++;
+  }
+
+  for (uint8_t b = 0; b < nblocks; b++)
+    mirror[gen_addr + b] = gen[b];
+
+  return count;
+}
+
+// tells every TWISlaveMem14 node (set up with setup_latch(...)) to snapshot its
+// telemetry at once
+bool twi_latch_all() {
+  char p[] = { TWI_GCALL_LATCH };
+
+  return twiQ.enqueue_wb(I2C_GENERAL_CALL_ADDRESS, p, sizeof(p), NULL);
+}
+
+typedef struct {
+  uint8_t addr;
+  uint8_t uid[TWI_UID_LEN];
+} twi_device_t;
+
+// true if any unassigned node's UID starts with the first nbits of uid
+static bool twi_arp_probe(const uint8_t *uid, uint8_t nbits) {
+  char c[2 + TWI_UID_LEN] = { TWI_GCALL_ARP_PREFIX, (char)nbits };
+  uint8_t n = (nbits + 7) / 8;
+
+  for (uint8_t k = 0; k < n; k++)
+    c[2 + k] = uid[k];
+
+  // a quick write, as every matching node ACKs at once; a read would have them
+  // all drive the data byte
+  return twiQ.enqueue_wb(I2C_GENERAL_CALL_ADDRESS, c, 2 + n, NULL) &&
+         twi_quick(TWI_ARP_ADDRESS, 0);
+}
+
+// the first address from a on that can be handed out: not the ARP address, and
+// not reserved (0x00 - 0x07, 0x78 - 0x7F); 0 if there are none left
+static uint8_t twi_arp_address(uint8_t a) {
+  if (a < 0x08)
+    a = 0x08;
+  if (a == TWI_ARP_ADDRESS)
+    a++;
+  return a < 0x78 ? a : 0;
+}
+
+// depth first search of the UID bits below a known prefix
+static void twi_arp_search(uint8_t *uid, uint8_t nbits, twi_device_t *table, uint8_t &n, uint8_t max, uint8_t &next_addr) {
+  if (n == max)
+    return;
+
+  if (nbits == TWI_UID_LEN * 8) {
+    uint8_t a = twi_arp_address(next_addr);
+    char c[2 + TWI_UID_LEN] = { TWI_GCALL_ARP_ASSIGN, (char)a };
+
+    if (a == 0)
+      return;
+    for (uint8_t k = 0; k < TWI_UID_LEN; k++)
+      c[2 + k] = table[n].uid[k] = uid[k];
+
+    if (twiQ.enqueue_wb(I2C_GENERAL_CALL_ADDRESS, c, sizeof(c), NULL)) {
+      table[n++].addr = a;
+      next_addr = a + 1;
+    }
+    return;
+  }
+
+  uint8_t m = 0x80 >> (nbits & 7);
+
+  uid[nbits / 8] &= ~m;
+  if (twi_arp_probe(uid, nbits + 1))
+    twi_arp_search(uid, nbits + 1, table, n, max, next_addr);
+
+  uid[nbits / 8] |= m;
+  if (twi_arp_probe(uid, nbits + 1))
+    twi_arp_search(uid, nbits + 1, table, n, max, next_addr);
+}
+
+// Finds every unassigned TWISlaveMem14 node (see setup_arp) and gives them
+// consecutive addresses from first_addr on, skipping TWI_ARP_ADDRESS and the
+// reserved ones, which they keep in EEPROM. Fills in at most max entries of
+// table and returns the number of nodes given an address.
+uint8_t twi_arp_enumerate(uint8_t first_addr, twi_device_t *table, uint8_t max) {
+  uint8_t uid[TWI_UID_LEN] = { 0 };
+  uint8_t n = 0;
+
+  if (twi_arp_probe(uid, 0))
+    twi_arp_search(uid, 0, table, n, max, first_addr);
+
+  return n;
+}
+
+#endif
@@ -2,30 +2,64 @@
 #include <avr/pgmspace.h>
 #include <assert.h>
 #include "TWIMaster.h"
+#ifdef USINGPEC
+#include "TWICrc8.h"
+#endif
 
 // for assert(...)
 //void abort(){}
 
-#define PIN_s_error     (1<<PA0)
-#define PIN_s_bus_error (1<<PA1)
-#define PIN_timer_vect  (1<<PA7)
-#define PIN_twi_vect    (1<<PA4)
-bool _timeout;
+// progress through a 10-bit address: 0 = not in one (or done), 1 = 11110xx0
+// sent, 2 = A7..A0 sent (a read now needs a repeated START and 11110xx1)
+static uint8_t tenbit;
 
 static void s_advance();
 
 twiQueue twiQ;
 
+#ifdef USINGSLAVE
+// the slave role; TWISlaveMem14.c compiled with -DTWI_DUAL_ROLE
+extern "C" void twi_slave_isr();
+
+static bool master_active; // TWIE is always set for the slave, so it can't tell us this
+static bool slave_active;  // addressed as a slave, and the transaction has not ended
+
+// TWEA must stay set whenever TWEA doesn't mean ACK/NACK of received data, or we
+// would stop recognizing our own slave address
+#define SLAVE_EA (1<<TWEA)
+#define IDLE_IE  (1<<TWIE)
+#else
+#define SLAVE_EA (0<<TWEA)
+#define IDLE_IE  (0<<TWIE)
+#endif
+
 /* TWI init_ support functions.
  */
 
+#ifdef USINGBUSLOAD
+static void busload_mark(bool busy);
+#else
+#define busload_mark(busy)
+#endif
+
 static inline void init_start() {
-  // .len == 0 if the command is a NOP
-  if (twiQ.currCmd().len > 0) {
+  // .len == 0 if the command is a NOP, unless it is a quick command
+  if (twiQ.currCmd().len > 0 || (twiQ.currCmd().flags & (1<<FLAG_QUICK_BIT))) {
+    busload_mark(true);
+    tenbit = 0;
     TWCR = (1<<TWEN)|                             // TWI Interface enabled.
            (1<<TWIE)|(1<<TWINT)|                  // Enable TWI Interupt and clear the flag.
-           (0<<TWEA)|(1<<TWSTA)|(0<<TWSTO)|       // Initiate a START condition.
+           SLAVE_EA|(1<<TWSTA)|(0<<TWSTO)|        // Initiate a START condition.
            (0<<TWWC);                             //
+    #ifdef USINGSLAVE
+    master_active = true;
+    #endif
+    #ifdef USINGLATENCY
+    // only the first START: a restart after a lost arbitration or a slave
+    // transaction is still time on the wire
+    if ( twiQ.currCmd().t_start == twiQ.currCmd().t_queued )
+      twiQ.currCmd().t_start = twiStampTimer::now();
+    #endif
   } else {
     twiQ.currCmd().state = (1<<STATE_SUCCESS_BIT);
     s_advance();
@@ -34,9 +68,13 @@ static inline void init_start() {
 
 static inline void init_stop() {
   TWCR = (1<<TWEN)|                                 // TWI Interface enabled
-         (0<<TWIE)|(1<<TWINT)|                      // Disable TWI Interrupt and clear the flag
-         (0<<TWEA)|(0<<TWSTA)|(1<<TWSTO)|           // Initiate a STOP condition.
+         IDLE_IE|(1<<TWINT)|                        // Disable TWI Interrupt (unless dual-role) and clear the flag
+         SLAVE_EA|(0<<TWSTA)|(1<<TWSTO)|            // Initiate a STOP condition.
          (0<<TWWC);
+  busload_mark(false);
+  #ifdef USINGSLAVE
+  master_active = false;
+  #endif
 }
 
 static inline void init_ack() {
@@ -53,8 +91,21 @@ static inline void init_nothing() {
          (0<<TWWC);
 }
 
+// as init_nothing(), for master transmitter states (where TWEA only matters
+// if we lose arbitration to someone addressing us)
+static inline void init_tx() {
+  TWCR = (1<<TWEN)|                                 // TWI Interface enabled
+         (1<<TWIE)|(1<<TWINT)|                      // Enable TWI Interupt and clear the flag to send next byte
+         SLAVE_EA|(0<<TWSTA)|(0<<TWSTO)|
+         (0<<TWWC);
+}
+
 static inline unsigned char twi_int_state() {
+  #ifdef USINGSLAVE
+  return master_active;
+  #else
   return (TWCR & (1<<TWIE));
+  #endif
 }
 
 /* Interput activity
@@ -62,17 +113,31 @@ static inline unsigned char twi_int_state() {
 
 static char *out_p, *out_q;
 static bool shouldRunCB = true;
+static uint8_t arb_retries; // times the current command has lost arbitration
+
+#ifdef USINGPEC
+// A read continues the PEC of the write just before it if that went to the same
+// slave, as in SMBus "read byte/word" where the PEC covers the command too. This
+// holds whether a repeated START or a STOP came between them, as TWISlaveMem14.c
+// can't tell the two apart; so twi_mem14_read's address write and read, which
+// are a STOP apart, are checked as one. pec_sla is the last SLA+W, or 0xFF after
+// a read, a failed command, a bus error or a timeout, none of which a PEC spans.
+static uint8_t pec;
+static uint8_t pec_sla = 0xFF;
+static bool pec_sent;
+#endif
 
 static void backend() {
   #ifdef USINGTIMER
   // reset timer counter if we're still doing TWI; otherwise disable the interrupt
   if (twi_int_state())
-    TCNT5 = 0;
+    twiTimer::reset();
   else
-    TIMSK5 = 0;
+    twiTimer::disable();
   #endif
 
-  if ( shouldRunCB ) {
+  // with twiCallbacksPolled this is left to twiQ.run_callbacks()
+  if ( twiQueue::policy::in_isr && shouldRunCB ) {
     while ( twiQ.hasCallback() ) {
       state_t &s = twiQ.currCallback();
 
@@ -101,15 +166,32 @@ static void s_raise() { // Should raise some assertion here.
 // _only_ set the TWSTO and TWINT flags (because it says the result of doing that is to
 // set the TWI bus into "the not addressed Slave mode"); it seems acceptable to just send
 // a normal TWI master stop
-static void s_advance_bus_error() {
+// the current command is over, however it went; if it lost arbitration, the
+// timeout s_ARB_LOST suspended must apply again to whatever comes next. Its
+// buffer is now its owner's again, so a status out of sequence (one without
+// s_START for the next command) must not reach it through out_p.
+static void end_cmd() {
   twiQ.doneCmd();
+  out_q = out_p;
+  #ifdef USINGTIMER
+  if ( arb_retries )
+    twiTimer::resume();
+  #endif
+  arb_retries = 0;
+}
+
+static void s_advance_bus_error() {
+  end_cmd();
+  #ifdef USINGPEC
+  pec_sla = 0xFF;
+  #endif
   init_stop();
   if ( twiQ.hasCmd() )
     init_start();
 }
 
 static void s_advance() {
-  twiQ.doneCmd();
+  end_cmd();
   if ( twiQ.hasCmd() )
     init_start();
   else
@@ -122,57 +204,246 @@ static void s_success() {
 }
 
 static void s_BUS_ERROR() {
-  PINA |= PIN_s_bus_error;
+  twiTrace::event(TWI_TRACE_BUS_ERROR);
 
-  if (_timeout) {
-    (twiQ.currCmd()).state = (TWSR & TWSR_STATUS_MASK) | (1<<STATE_TIMEOUT_BIT);
-    _timeout = false;
+  #ifdef USINGSLAVE
+  if (!master_active) {
+    slave_active = false;
+    twi_slave_isr();
+    return;
   }
-  else
-    (twiQ.currCmd()).state = (TWSR & TWSR_STATUS_MASK);
+  #endif
+
+  (twiQ.currCmd()).state = (TWSR & TWSR_STATUS_MASK);
 
   s_advance_bus_error();
 }
 
 static void s_ERROR() {
-  PINA |= PIN_s_error;
+  twiTrace::event(TWI_TRACE_ERROR);
   (twiQ.currCmd()).state = (TWSR & TWSR_STATUS_MASK);
+  #ifdef USINGPEC
+  pec_sla = 0xFF;
+  #endif
   s_advance();
 }
 
 static void s_TX_NEXT() {
+  if ( tenbit ) {
+    state_t &s = twiQ.currCmd();
+
+    if ( tenbit == 1 ) {
+      tenbit = 2;
+      #ifdef USINGPEC
+      pec = crc8(pec, s.addr_lo);
+      #endif
+      TWDR = s.addr_lo;
+      init_tx();
+      return;
+    }
+
+    if ( s.addr & (1<<TWI_READ_BIT) ) {
+      TWCR = (1<<TWEN)|                               // TWI Interface enabled.
+             (1<<TWIE)|(1<<TWINT)|                    // Enable TWI Interupt and clear the flag.
+             SLAVE_EA|(1<<TWSTA)|(0<<TWSTO)|          // Initiate a repeated START condition.
+             (0<<TWWC);
+      return;
+    }
+
+    tenbit = 0;
+  }
+
   if ( out_p != out_q ) {
+    #ifdef USINGPEC
+    pec = crc8(pec, *out_p);
+    #endif
     TWDR = *out_p++;
-    init_nothing();
-  } else
+    init_tx();
+  }
+  #ifdef USINGPEC
+  else if ( (twiQ.currCmd().flags & (1<<FLAG_PEC_BIT)) && !pec_sent ) {
+    TWDR = pec;
+    pec = 0;
+    pec_sent = true;
+    init_tx();
+  }
+  #endif
+  else
     s_success();
 }
 
 static void s_START() {
   state_t &s = twiQ.currCmd();
-  out_p = s.buff;
+
+  // the repeated START of a 10-bit read; 11110xx1 ends the address
+  if ( tenbit == 2 ) {
+    tenbit = 0;
+    #ifdef USINGPEC
+    pec = crc8(pec, s.addr);
+    #endif
+    TWDR = s.addr;
+    init_tx();
+    return;
+  }
+
+  // a 10-bit address always starts as a write of 11110xx0 and A7..A0
+  char sla = s.addr;
+  if ( s.flags & (1<<FLAG_TENBIT_BIT) ) {
+    tenbit = 1;
+    sla &= ~(1<<TWI_READ_BIT);
+  }
+
+  #ifdef USINGTIMER
+  // re-arm the timeout, in case it was suspended by s_ARB_LOST
+  if ( arb_retries )
+    twiTimer::resume();
+  #endif
+  out_p = state_data(&s);
   out_q = out_p + s.len;
-  TWDR = s.addr;
-  init_nothing();
+
+  #ifdef USINGPEC
+  if ( s.addr & (1<<TWI_READ_BIT) ) {
+    if ( (uint8_t)(s.addr & ~(1<<TWI_READ_BIT)) != pec_sla )
+      pec = 0;
+    pec_sla = 0xFF;
+
+    // the PEC byte is read as one more byte, but is not stored
+    if ( s.flags & (1<<FLAG_PEC_BIT) )
+      out_q++;
+  } else {
+    pec = 0;
+    pec_sla = s.addr;
+  }
+  pec = crc8(pec, sla);
+  pec_sent = false;
+  #endif
+
+  TWDR = sla;
+  init_tx();
 }
 
+// A read of len == 0 (a quick command) still has to clock in one byte, as the
+// hardware can't STOP straight after SLA+R; that byte is dropped.
 static void s_RX_LAST() {
-  *out_p++ = TWDR;
+  #ifdef USINGPEC
+  if ( twiQ.currCmd().flags & (1<<FLAG_PEC_BIT) ) {
+    pec = crc8(pec, TWDR);
+    if ( pec != 0 ) {
+      (twiQ.currCmd()).state = (TWSR & TWSR_STATUS_MASK) | (1<<STATE_PEC_BIT);
+      s_advance();
+      return;
+    }
+    s_success();
+    return;
+  }
+  pec = crc8(pec, TWDR);
+  #endif
+  if ( out_p != out_q )
+    *out_p++ = TWDR;
   s_success();
 }
 
 static void s_RX_SKIP() {
-  if ( out_p != (out_q-1) )
+  if ( out_q - out_p > 1 )
     init_ack();
   else
     init_nothing();
 }
 
 static void s_RX_NEXT() {
-  *out_p++ = TWDR;
+  #ifdef USINGPEC
+  pec = crc8(pec, TWDR);
+  #endif
+  if ( out_p != out_q )
+    *out_p++ = TWDR;
+
+  // the first byte of a block read is the number of bytes that follow; read at
+  // most what fits in the rest of the buffer. The count was ACKed, so one more
+  // byte comes even if none fits; it is NACKed, and s_RX_LAST drops it or
+  // takes it as the PEC.
+  state_t &s = twiQ.currCmd();
+  if ( (s.flags & (1<<FLAG_BLOCK_BIT)) && out_p == state_data(&s) + 1 ) {
+    twi_len_t n = (uint8_t)out_p[-1];
+    twi_len_t room = s.len - 1;
+
+    if ( n > room )
+      n = room;
+    out_q = out_p + n;
+    #ifdef USINGPEC
+    if ( s.flags & (1<<FLAG_PEC_BIT) )
+      out_q++;
+    #endif
+  }
+
   s_RX_SKIP();
 }
 
+// Lost arbitration to another master without being addressed; the hardware is
+// now a non-addressed slave. The command stays at the head of the queue and a
+// START is sent as soon as the bus is free, which restarts it from its first
+// byte (see s_START). The timeout is suspended meanwhile, as the other master
+// may legitimately hold the bus for longer than it allows.
+static void s_ARB_LOST() {
+  if ( ++arb_retries > TWI_ARB_RETRIES ) {
+    s_ERROR();
+    return;
+  }
+
+  #ifdef USINGTIMER
+  twiTimer::disable();
+  #endif
+  tenbit = 0;
+  TWCR = (1<<TWEN)|
+         (1<<TWIE)|(1<<TWINT)|
+         SLAVE_EA|(1<<TWSTA)|(0<<TWSTO)|
+         (0<<TWWC);
+}
+
+#ifdef USINGSLAVE
+static void start_cmd();
+
+// Addressed as a slave, perhaps having lost arbitration for our own command
+// (0x68, 0x78, 0xB0). When the slave transaction is over, the pending
+// command, if any, is restarted.
+static void s_SLAVE() {
+  unsigned char twsr = TWSR & TWSR_STATUS_MASK;
+
+  master_active = false;
+  slave_active = true;
+
+  if ( twsr == 0x68 || twsr == 0x78 || twsr == 0xB0 )
+    arb_retries++;
+
+  twi_slave_isr();
+
+  switch (twsr) {
+    case 0x88: // data NACKed; we are no longer addressed
+    case 0x98:
+    case 0xA0: // STOP or repeated START
+    case 0xC0: // last byte sent
+    case 0xC8:
+      slave_active = false;
+      if ( twiQ.hasCmd() && arb_retries > TWI_ARB_RETRIES ) {
+        (twiQ.currCmd()).state = 0x38; // as if s_ARB_LOST had given up
+        #ifdef USINGPEC
+        pec_sla = 0xFF;
+        #endif
+        end_cmd();
+      }
+      if ( twiQ.hasCmd() )
+        start_cmd();
+      break;
+  }
+}
+#else
+// Without USINGSLAVE we can still be addressed (at TWAR's reset value) after
+// losing arbitration in a read, as TWEA is set to ACK the bytes read. Leaving
+// TWINT set would enter this ISR again for good, starving the timeout, so it is
+// handled as a lost arbitration: TWEA is cleared, so we are soon no longer
+// addressed, and the command is restarted when the bus is free.
+#define s_SLAVE    s_ARB_LOST
+#endif
+
 const state_fp state_table[] PROGMEM = {
   s_BUS_ERROR, // TWI_BUS_ERROR            0x00  // 00 Bus error due to an illegal START or STOP condition
   s_START,   // TWI_START                  0x08  // 01 START has been transmitted
@@ -181,26 +452,26 @@ const state_fp state_table[] PROGMEM = {
   s_ERROR,   // TWI_MTX_ADR_NACK           0x20  // 04 SLA+W has been tramsmitted and NACK received
   s_TX_NEXT, // TWI_MTX_DATA_ACK           0x28  // 05 Data byte has been tramsmitted and ACK received
   s_ERROR,   // TWI_MTX_DATA_NACK          0x30  // 06 Data byte has been tramsmitted and NACK received
-  s_ERROR,   // TWI_ARB_LOST               0x38  // 07 Arbitration lost
+  s_ARB_LOST, // TWI_ARB_LOST             0x38  // 07 Arbitration lost
   s_RX_SKIP, // TWI_MRX_ADR_ACK            0x40  // 08 SLA+R has been tramsmitted and ACK received
   s_ERROR,   // TWI_MRX_ADR_NACK           0x48  // 09 SLA+R has been tramsmitted and NACK received
   s_RX_NEXT, // TWI_MRX_DATA_ACK           0x50  // 0a Data byte has been received and ACK tramsmitted
   s_RX_LAST, // TWI_MRX_DATA_NACK          0x58  // 0b Data byte has been received and NACK tramsmitted
-  s_raise,   // TWI_SRX_ADR_ACK            0x60  // 0c Own SLA+W has been received ACK has been returned
-  s_raise,   // TWI_SRX_ADR_ACK_M_ARB_LOST 0x68  // 0d Arbitration lost in SLA+R/W as Master; own SLA+W has been received; ACK has been returned
-  s_raise,   // TWI_SRX_GEN_ACK            0x70  // 0e General call address has been received; ACK has been returned
-  s_raise    // TWI_SRX_GEN_ACK_M_ARB_LOST 0x78  // 0f Arbitration lost in SLA+R/W as Master; General call address has been received; ACK has been returned
+  s_SLAVE,   // TWI_SRX_ADR_ACK            0x60  // 0c Own SLA+W has been received ACK has been returned
+  s_SLAVE,   // TWI_SRX_ADR_ACK_M_ARB_LOST 0x68  // 0d Arbitration lost in SLA+R/W as Master; own SLA+W has been received; ACK has been returned
+  s_SLAVE,   // TWI_SRX_GEN_ACK            0x70  // 0e General call address has been received; ACK has been returned
+  s_SLAVE    // TWI_SRX_GEN_ACK_M_ARB_LOST 0x78  // 0f Arbitration lost in SLA+R/W as Master; General call address has been received; ACK has been returned
   ,
-  s_raise,   // TWI_SRX_ADR_DATA_ACK       0x80  // 10 Previously addressed with own SLA+W; data has been received; ACK has been returned
-  s_raise,   // TWI_SRX_ADR_DATA_NACK      0x88  // 11 Previously addressed with own SLA+W; data has been received; NOT ACK has been returned
-  s_raise,   // TWI_SRX_GEN_DATA_ACK       0x90  // 12 Previously addressed with general call; data has been received; ACK has been returned
-  s_raise,   // TWI_SRX_GEN_DATA_NACK      0x98  // 13 Previously addressed with general call; data has been received; NOT ACK has been returned
-  s_raise,   // TWI_SRX_STOP_RESTART       0xA0  // 14 A STOP condition or repeated START condition has been received while still addressed as Slave
-  s_raise,   // TWI_STX_ADR_ACK            0xA8  // 15 Own SLA+R has been received; ACK has been returned
-  s_raise,   // TWI_STX_ADR_ACK_M_ARB_LOST 0xB0  // 16 Arbitration lost in SLA+R/W as Master; own SLA+R has been received; ACK has been returned
-  s_raise,   // TWI_STX_DATA_ACK           0xB8  // 17 Data byte in TWDR has been transmitted; ACK has been received
-  s_raise,   // TWI_STX_DATA_NACK          0xC0  // 18 Data byte in TWDR has been transmitted; NOT ACK has been received
-  s_raise,   // TWI_STX_DATA_ACK_LAST_BYTE 0xC8  // 19 Last data byte in TWDR has been transmitted (TWEA = ì0î); ACK has been received
+  s_SLAVE,   // TWI_SRX_ADR_DATA_ACK       0x80  // 10 Previously addressed with own SLA+W; data has been received; ACK has been returned
+  s_SLAVE,   // TWI_SRX_ADR_DATA_NACK      0x88  // 11 Previously addressed with own SLA+W; data has been received; NOT ACK has been returned
+  s_SLAVE,   // TWI_SRX_GEN_DATA_ACK       0x90  // 12 Previously addressed with general call; data has been received; ACK has been returned
+  s_SLAVE,   // TWI_SRX_GEN_DATA_NACK      0x98  // 13 Previously addressed with general call; data has been received; NOT ACK has been returned
+  s_SLAVE,   // TWI_SRX_STOP_RESTART       0xA0  // 14 A STOP condition or repeated START condition has been received while still addressed as Slave
+  s_SLAVE,   // TWI_STX_ADR_ACK            0xA8  // 15 Own SLA+R has been received; ACK has been returned
+  s_SLAVE,   // TWI_STX_ADR_ACK_M_ARB_LOST 0xB0  // 16 Arbitration lost in SLA+R/W as Master; own SLA+R has been received; ACK has been returned
+  s_SLAVE,   // TWI_STX_DATA_ACK           0xB8  // 17 Data byte in TWDR has been transmitted; ACK has been received
+  s_SLAVE,   // TWI_STX_DATA_NACK          0xC0  // 18 Data byte in TWDR has been transmitted; NOT ACK has been received
+  s_SLAVE,   // TWI_STX_DATA_ACK_LAST_BYTE 0xC8  // 19 Last data byte in TWDR has been transmitted (TWEA = ì0î); ACK has been received
   s_raise,                                       // 1a
   s_raise,                                       // 1b
   s_raise,                                       // 1c
@@ -213,53 +484,180 @@ const state_fp state_table[] PROGMEM = {
 // Front ends. Interupt entry points.
 
 #ifdef USINGTIMER
-ISR(TIMER5_COMPA_vect) {
-  _timeout = true;
-
+ISR(TWI_TIMER_vect) {
   // reset the bus (dealing with the bus errors caused via illegal 
   // STOP conditions turned out to be a royal pain)
   TWCR = 0;
-  TWCR = (1<<TWEN);
+  TWCR = (1<<TWEN) | IDLE_IE | SLAVE_EA;
+  busload_mark(false);
+  #ifdef USINGSLAVE
+  master_active = false;
+  #endif
   
   // nothing else calls this when there is a timeout (s_advance is not called)
-  twiQ.doneCmd();
+  if ( twiQ.hasCmd() ) {
+    (twiQ.currCmd()).state = (1<<STATE_TIMEOUT_BIT);
+    end_cmd();
+  }
+  arb_retries = 0;
+  #ifdef USINGPEC
+  pec_sla = 0xFF;
+  #endif
   
-  PINA |= PIN_timer_vect;
-  TIMSK5 = 0;
+  twiTrace::event(TWI_TRACE_TIMEOUT);
+  twiTimer::disable();
+
+  // start the commands queued behind it, and run its callback; left for the
+  // next enqueue, they would wait for good with a full queue
+  kick_isr();
 }
 #endif
 
+static void start_cmd() {
+  init_start();
+  #ifdef USINGTIMER
+  twiTimer::arm();
+  #endif
+}
+
 void kick_isr() {
+  #ifdef USINGSLAVE
+  // a slave transaction must finish first; s_SLAVE starts the command after it
+  if ( !twi_int_state() && !slave_active ) {
+  #else
   if ( !twi_int_state() ) {
-    if ( twiQ.hasCmd() ) {
-      init_start();
-      #ifdef USINGTIMER
-      TCNT5 = 0;
-      // there will likely be a pending interrupt, which we must cancel
-      TIFR5 |= (1<<OCF5A); // TIFRn is in the first 32 I/O registers, meaning 
-                           // this will turn into an sbi instruction
-      TIMSK5 = (1<<OCIE5A);
-      #endif
-    }
+  #endif
+    if ( twiQ.hasCmd() )
+      start_cmd();
   }
 
   backend();
 }
 
 ISR(TWI_vect) {
-  PORTA |= PIN_twi_vect;
-  TCNT2 = 0;
-  SPDR = TWSR;
+  twiTrace::isr_enter(TWSR & TWSR_STATUS_MASK);
   unsigned char twsr = TWSR / 8;
 
   ( (void (*)()) (pgm_read_word(&state_table[twsr])) ) ();
 
   backend();
-  PORTA &= ~PIN_twi_vect;
+  twiTrace::isr_exit();
+}
+
+
+#ifdef USINGLATENCY
+static twi_latency_t twi_latency;
+
+// bucket b holds times of 2^(b-1) to 2^b - 1 ticks
+static uint8_t latency_bucket(uint16_t t) {
+  uint8_t b = 0;
+
+  if (t & 0xFF00) {
+    b = 8;
+    t >>= 8;
+  }
+  while (t) {
+    b++;
+    t >>= 1;
+  }
+
+  return b < TWI_LATENCY_BUCKETS ? b : TWI_LATENCY_BUCKETS - 1;
+}
+
+static inline void latency_count(uint16_t *h, uint16_t t) {
+  uint16_t *p = &h[latency_bucket(t)];
+
+  if (*p != 0xFFFF)
+    ++*p;
+}
+
+void twi_latency_record(state_t *s) {
+  if (twi_latency.addr != 0xFF && twi_latency.addr != (uint8_t)s->addr >> TWI_ADR_BITS)
+    return;
+
+  uint16_t now = twiStampTimer::now();
+
+  latency_count(twi_latency.queued, s->t_start - s->t_queued);
+  latency_count(twi_latency.wire, now - s->t_start);
+  latency_count(twi_latency.total, now - s->t_queued);
+}
+
+void twi_latency_clear(uint8_t addr) {
+  uint8_t sreg = SREG;
+  cli();
+  memset(&twi_latency, 0, sizeof(twi_latency));
+  twi_latency.addr = addr;
+  SREG = sreg;
 }
 
+void twi_latency_snapshot(twi_latency_t *dst) {
+  uint8_t sreg = SREG;
+  cli();
+  *dst = twi_latency;
+  SREG = sreg;
+}
+#endif
+
+#ifdef USINGBUSLOAD
+static twi_busload_t twi_busload;
+static bool busload_busy;
+static uint16_t busload_since;   // when busy or idle was last brought up to date
+static uint32_t busload_window;  // twi_busload.busy at the start of this timer period
+static bool busload_warned;
+
+// adds the time since busload_since to busy or idle; busy is what the bus is from now on
+static void busload_mark(bool busy) {
+  uint16_t now = twiStampTimer::now();
+  uint16_t t = now - busload_since;
+
+  if (busload_busy)
+    twi_busload.busy += t;
+  else
+    twi_busload.idle += t;
+
+  busload_since = now;
+  busload_busy = busy;
+}
+
+// every 2^16 ticks, which also keeps now - busload_since from wrapping
+ISR(TWI_STAMP_OVF_vect) {
+  busload_mark(busload_busy);
+
+  uint32_t busy = twi_busload.busy - busload_window;
+  busload_window = twi_busload.busy;
+
+  // a quarter of this period's share, and three quarters of the average so far
+  uint8_t percent = (uint32_t)busy * 100 >> 16;
+  twi_busload.percent = ((uint16_t)twi_busload.percent * 3 + percent) / 4;
+
+  if (twi_busload.percent > TWI_BUSLOAD_THRESHOLD) {
+    if (!busload_warned)
+      TWIBusLoadWarning(twi_busload.percent);
+    busload_warned = true;
+  } else
+    busload_warned = false;
+}
+
+void twi_busload_clear() {
+  uint8_t sreg = SREG;
+  cli();
+  busload_since = twiStampTimer::now();
+  twi_busload.busy = twi_busload.idle = busload_window = 0;
+  twi_busload.percent = 0;
+  busload_warned = false;
+  SREG = sreg;
+}
+
+void twi_busload_snapshot(twi_busload_t *dst) {
+  uint8_t sreg = SREG;
+  cli();
+  busload_mark(busload_busy);
+  *dst = twi_busload;
+  SREG = sreg;
+}
+#endif
 
-void twiQueue::blocking_callback(state_t *s) {
+void twiQueueBlocking::blocking_callback(state_t *s) {
   if (_blocking_donefunc != NULL)
     _blocking_donefunc(s);
 
@@ -268,6 +666,6 @@ void twiQueue::blocking_callback(state_t *s) {
   _blocking_callback_called = true;
 }
 
-volatile bool twiQueue::_blocking_callback_called = true;
-volatile char twiQueue::_blocking_state = 0;
-callback_fp twiQueue::_blocking_donefunc = NULL;
+volatile bool twiQueueBlocking::_blocking_callback_called = true;
+volatile char twiQueueBlocking::_blocking_state = 0;
+callback_fp twiQueueBlocking::_blocking_donefunc = NULL;
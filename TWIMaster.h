@@ -3,93 +3,323 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <string.h>
 #include <avr/io.h>
 #include <avr/interrupt.h>
+#include "TWIClock.h"
 
-// For now the timer is hardwired to Timer5; changing that would require at least #ifdefs
-// for the ISR, as there is no way to parameterize it after the preprocessor has run
-// (remember that ISR(...) is a macro). Either all of the relevant timer registers would
-// need to be passed as arguments and stored (requiring pointer access), #ifdefed into
-// place (ugly), or done via template (which would require #pragma push_macro and 
-// redefinitions of the _SFR_{MEM|IO}{8|16} macros). See ./metaprogramming.txt for an
-// example which compiles.
+// Times out a transfer that stalls (see TIMEOUT_TWI_CLOCKS) using TimerN, N = TWI_TIMER:
+// 1, 3, 4 or 5 (16-bit) or 0 or 2 (8-bit, with a prescaler). The default is Timer5 where
+// there is one, e.g. the ATmega2560, otherwise Timer1. Set it from Makefile.config with
+// -DTWI_TIMER=N if that timer is in use for something else. See TWITimeout.h
 #define USINGTIMER
+#ifndef TWI_TIMER
+#ifdef TIMSK5
+#define TWI_TIMER 5
+#else
+#define TWI_TIMER 1
+#endif
+#endif
+
+// Uncomment to allow SMBus packet error codes on transfers enqueued with (1<<FLAG_PEC_BIT);
+// this costs a PROGMEM lookup per byte in the ISR
+//#define USINGPEC
+
+// Uncomment to make this a dual-role driver: the slave states are handed to
+// TWISlaveMem14.c (compiled with -DTWI_DUAL_ROLE, which drops its own ISR), the
+// slave address stays enabled while the master is idle, and a command that
+// loses arbitration, or is interrupted by being addressed, is restarted once
+// the bus is free. Call i2c_master_initialize() before the slave's setup(...).
+//#define USINGSLAVE
+
+// Uncomment for 16-bit transfer lengths, so that a DMP image or an EEPROM dump can
+// go out as one transaction instead of many chunks of <= 255 bytes; this costs a
+// byte per queue entry and 16-bit length arithmetic at enqueue
+//#define USINGBULK
+
+// Uncomment to let transfers of up to TWI_INLINE_LEN bytes carry their data in the
+// queue entry itself (see enqueue_w_inline), so a non-blocking write needn't keep
+// its buffer alive until the callback; this costs TWI_INLINE_LEN - sizeof(char*)
+// bytes per queue entry
+//#define USINGINLINE
+#define TWI_INLINE_LEN 4
+
+// Uncomment if only the main loop enqueues (not callbacks run from the TWI ISR, nor
+// other ISRs): entries are then filled with interrupts enabled and published with a
+// single byte store, so only kick_isr() runs with interrupts off. Needs an 8-bit
+// TWI_QUEUE_INDEX, and twiCallbacksPolled if callbacks enqueue.
+//#define USINGSINGLEPRODUCER
+
+// Uncomment to time every transaction with the TWI_STAMP_TIMER, into log2 histograms of
+// the time from enqueue to START (queueing) and from START to completion (on the wire,
+// including clock stretching and arbitration retries); see twi_latency_snapshot(...).
+// This costs 4 bytes per queue entry, 97 bytes of histograms and a few dozen cycles
+// per transaction
+//#define USINGLATENCY
+#define TWI_LATENCY_BUCKETS 16 // bucket b counts times of 2^(b-1) to 2^b - 1 ticks; the last also counts longer ones
+
+// Uncomment to measure how much of the time the master has a transaction on the bus
+// (from its START to its STOP) with the TWI_STAMP_TIMER; see twi_busload_snapshot(...).
+// The percentage is updated each time the timer wraps, and TWIBusLoadWarning(percent),
+// which you must define, is called from that ISR when it rises above TWI_BUSLOAD_THRESHOLD
+//#define USINGBUSLOAD
+#define TWI_BUSLOAD_THRESHOLD 80
+
+// Uncomment to make twiTraceRecord (see TWIRecord.h) available as a TWI_TRACE backend:
+// it keeps the last TWI_RECORD_LEN TWSR transitions, timeouts and enqueues, with
+// TWI_STAMP_TIMER timestamps, for replay on a PC by example/host_sim/twi_replay
+//#define USINGRECORD
+#ifndef TWI_RECORD_LEN
+#define TWI_RECORD_LEN 64 // a power of 2; 5 bytes each
+#endif
+
+// the free-running 16-bit timer (not TWI_TIMER) used by USINGLATENCY, USINGBUSLOAD and USINGRECORD
+#ifndef TWI_STAMP_TIMER
+#ifdef TIMSK4
+#define TWI_STAMP_TIMER 4
+#else
+#define TWI_STAMP_TIMER 1
+#endif
+#endif
+#define TWI_STAMP_CS 2 // clock select bits: /8, i.e. 0.5us per tick and 32ms before wrapping at 16MHz
 
 /* hardware-specific config
 */
-#define TWI_TWBR 0x0C // 400 KHz
+#ifndef F_CPU
+#error "F_CPU must be defined (see Makefile.config) to work out the TWI bit rate"
+#endif
+#define TWI_SCL_HZ 400000UL   // SCL is never faster than this, and the build fails if it would be
+#define TWI_SCL_TOLERANCE 10  // ... or more than this many percent slower
+#define TWI_TWPS twi_twps(F_CPU, TWI_SCL_HZ)
+#define TWI_TWBR twi_twbr(F_CPU, TWI_SCL_HZ) // 0x0C at 16MHz
+static_assert(twi_scl_ok(F_CPU, TWI_SCL_HZ, TWI_SCL_TOLERANCE),
+              "TWI_SCL_HZ can't be met within TWI_SCL_TOLERANCE at this F_CPU");
 #define TWI_READ_BIT  0       // Bit position for R/W bit in "address byte".
 #define TWI_ADR_BITS  1       // Bit position for LSB of the slave address bits in the init byte.
 #define TWSR_STATUS_MASK 0xF8 // 3 LSB are baud rate prescalar
 #define STATE_SUCCESS_BIT 0   // this bit is set in sate_s.state on callback if no error
-#define STATE_TIMEOUT_BIT 1   // this bit is set in sate_s.state on callback if no error
+#define STATE_TIMEOUT_BIT 1   // this bit is set in sate_s.state on callback if the command timed out
+#define STATE_PEC_BIT 2       // this bit is set in sate_s.state on callback if the received PEC was wrong
+#define FLAG_PEC_BIT 0        // set this bit in flags to append (write) or check (read) an SMBus PEC
+#define FLAG_TENBIT_BIT 1     // set in flags by the enqueue_*10 functions: addr is 11110xxR, addr_lo is A7..A0
+#define FLAG_BLOCK_BIT 2      // set this bit in flags for an SMBus block read: the first byte read is the count
+#define FLAG_QUICK_BIT 3      // set this bit in flags (with len == 0) for an SMBus quick command
+#define FLAG_INLINE_BIT 4     // set by the enqueue_*_inline functions: the data is in state_s.data, not at buff
+#define TWI_TENBIT_PREFIX 0xF0 // first address byte of a 10-bit address, before A9, A8 and R/W
 #define TIMEOUT_TWI_CLOCKS 32 // the absolute minimum is 13, but that assumes zero delay in the slave
+#define TWI_ARB_RETRIES 8     // restarts of a command after losing arbitration before it fails with 0x38
 
 
-/* debugging
+#if defined(USINGLATENCY) || defined(USINGBUSLOAD) || defined(USINGRECORD)
+#define TWI_USINGSTAMPS
+#endif
+
+#if defined(USINGTIMER) || defined(TWI_USINGSTAMPS)
+#include "TWITimeout.h"
+#endif
+
+#ifdef USINGTIMER
+
+// a timeout of TIMEOUT_TWI_CLOCKS SCL clocks is this many CPU clocks
+#define TWI_TIMEOUT_CYCLES (twi_scl_cycles(TWI_TWBR, TWI_TWPS) * TIMEOUT_TWI_CLOCKS)
+#define TWI_TIMER_vect TWI_PASTE3_X(TIMER, TWI_TIMER, _COMPA_vect)
+
+typedef twiTimeout<TWI_TIMER, TWI_TIMEOUT_CYCLES> twiTimer;
+#endif
+
+#ifdef TWI_USINGSTAMPS
+#if defined(USINGTIMER) && TWI_STAMP_TIMER == TWI_TIMER
+#error "TWI_STAMP_TIMER must not be TWI_TIMER, which is reset on every TWI interrupt"
+#endif
+#define TWI_STAMP_OVF_vect TWI_PASTE3_X(TIMER, TWI_STAMP_TIMER, _OVF_vect)
+
+typedef twiFreeRunning<TWI_STAMP_TIMER, TWI_STAMP_CS> twiStampTimer;
+#endif
+
+
+/* debugging; see TWITrace.h
 */
-#define PIN_iFree (1<<PA5)
-#define PIN_iCmd  (1<<PA6)
-#define PIN_iCallback (1<<PA7)
+#include "TWITrace.h"
+#ifdef USINGRECORD
+#include "TWIRecord.h"
+#endif
+
+typedef TWI_TRACE twiTrace;
 
-#define INC_INDEX(idx) //PINA |= idx
+// stops the compiler moving memory accesses across it (the AVR doesn't reorder them)
+#define TWI_BARRIER() asm volatile ("" ::: "memory")
 
 
 /* TWI Queue
 */
 void kick_isr();
 
-// size is 2^NQBits, with max useful size of 2^NQBits - 1
+// twiQ is a twiQueueT<TWI_QUEUE_SIZE, TWI_QUEUE_INDEX, TWI_QUEUE_POLICY>; these
+// can be overridden from Makefile.config (e.g. -DTWI_QUEUE_SIZE=64) rather than here.
+// The size must be a power of 2, with max useful size of TWI_QUEUE_SIZE - 1
 // (ring buffer needs >= 1 empty spot to avoid more complicated management)
-#define NQBits 4
+#ifndef TWI_QUEUE_SIZE
+#define TWI_QUEUE_SIZE 16
+#endif
+// uint8_t is enough for up to 256 entries, and is a single register on the AVR
+#ifndef TWI_QUEUE_INDEX
+#define TWI_QUEUE_INDEX uint8_t
+#endif
+#ifndef TWI_QUEUE_POLICY
+#define TWI_QUEUE_POLICY twiCallbacksInISR
+#endif
+
 struct state_s;
 
 typedef void (*callback_fp)(struct state_s*);
 typedef void (*state_fp)();
-typedef int qindex;
+
+#ifdef USINGBULK
+typedef uint16_t twi_len_t;
+#else
+typedef uint8_t twi_len_t;
+#endif
 
 typedef struct state_s {
+#ifdef USINGINLINE
+  union {
+    char *buff;
+    char data[TWI_INLINE_LEN];
+  };
+#else
   char *buff;
+#endif
   char addr;
   char state;
-  char len;
+  twi_len_t len;
+  char flags;
+  char addr_lo; // only used for 10-bit addresses
   callback_fp donefunc;
+#ifdef USINGLATENCY
+  uint16_t t_queued; // twiStampTimer::now() at enqueue
+  uint16_t t_start;  // ... and when START was first sent
+#endif
 } state_t;
 
 #define NOSTATE ((state_t*)0)
 
+#ifdef USINGLATENCY
+typedef struct {
+  uint16_t queued[TWI_LATENCY_BUCKETS]; // enqueue to START
+  uint16_t wire[TWI_LATENCY_BUCKETS];   // START to completion
+  uint16_t total[TWI_LATENCY_BUCKETS];  // enqueue to completion
+  uint8_t addr;                         // only this 7-bit address is counted; 0xFF for all
+} twi_latency_t;
+
+// called (from the ISR) as each command completes, successfully or not
+void twi_latency_record(state_t *s);
+// zeroes the histograms, and restricts them to the device at addr (0xFF for all)
+void twi_latency_clear(uint8_t addr);
+// copies the histograms atomically
+void twi_latency_snapshot(twi_latency_t *dst);
+#endif
+
+#ifdef USINGBUSLOAD
+typedef struct {
+  uint32_t busy;   // TWI_STAMP_TIMER ticks from START to STOP, or a timeout
+  uint32_t idle;   // ... and the rest
+  uint8_t percent; // rolling average of the busy share of the last few timer periods
+} twi_busload_t;
+
+// user-supplied; called from an ISR, so keep it short
+void TWIBusLoadWarning(uint8_t percent);
+// zeroes the totals
+void twi_busload_clear();
+// copies the totals atomically
+void twi_busload_snapshot(twi_busload_t *dst);
+#endif
+
+// where the bytes of s are: in the queue entry for the enqueue_*_inline functions,
+// otherwise at buff
+static inline char *state_data(state_t *s) {
+#ifdef USINGINLINE
+  if (s->flags & (1<<FLAG_INLINE_BIT))
+    return s->data;
+#endif
+  return s->buff;
+}
+
+
+/* Callback policies for twiQueueT; the unused mode compiles to nothing.
+*/
+
+// donefuncs are called at the end of the TWI ISR, with interrupts enabled
+struct twiCallbacksInISR {
+  enum { in_isr = 1 };
+};
+
+// donefuncs are only called from twiQ.run_callbacks(), which the main loop must
+// call (the blocking enqueues call it while they wait); nothing of the caller's
+// runs in interrupt context
+struct twiCallbacksPolled {
+  enum { in_isr = 0 };
+};
+
+// Called at the start of twiQ.run_callbacks() whatever the policy, and so at
+// every turn of the blocking enqueues' wait loops, e.g. with
+// -D'TWI_POLL_HOOK()=wdt_reset()' to keep a watchdog fed through a long
+// transfer. The host simulator (example/host_sim) runs the bus from it.
+#ifndef TWI_POLL_HOOK
+#define TWI_POLL_HOOK()
+#endif
+
+// state shared by the blocking enqueues, whatever the queue's parameters
+class twiQueueBlocking {
+protected:
+  static volatile bool _blocking_callback_called;
+  static volatile char _blocking_state;
+  static callback_fp _blocking_donefunc;
+  static void blocking_callback(state_t *s);
+};
 
-class twiQueue {
+template <uint16_t Capacity, class IndexT, class Policy>
+class twiQueueT : private twiQueueBlocking {
 private:
-  enum { qSize = (1<<NQBits),
-         qMask = (1<<NQBits)-1 };
+  // Capacity must be a power of 2 whose indices fit in IndexT
+  typedef char check_capacity[(Capacity >= 2 && (Capacity & (Capacity-1)) == 0 &&
+                               (IndexT)(Capacity-1) == Capacity-1) ? 1 : -1];
+#ifdef USINGSINGLEPRODUCER
+  // iFree is published with a single store, which the ISR must see all or nothing of
+  typedef char check_index_atomic[sizeof(IndexT) == 1 ? 1 : -1];
+#endif
+
+  enum { qSize = Capacity,
+         qMask = Capacity-1 };
 
   state_t queue[qSize];
-  qindex iCmd, iCallback, iFree;
+  IndexT iCmd, iCallback, iFree;
 
 public:
-  twiQueue() : iCmd(0), iCallback(0), iFree(0)
+  typedef IndexT index_t;
+  typedef Policy policy;
+
+  twiQueueT() : iCmd(0), iCallback(0), iFree(0)
   {}
 
-  inline qindex nextIndex(qindex index) {
+  inline IndexT nextIndex(IndexT index) {
     return (index + 1) & qMask;
   }
 
-  inline bool validIndex(qindex index) {
-    return 0 <= index && index < qSize;
+  inline bool validIndex(IndexT index) {
+    return index < qSize;
   }
 
   // returns
   //   state_t* if a slot is free
   //   NOSTATE otherwise
   state_t* allocFree() {
-    qindex old = iFree;
-    qindex i = nextIndex(iFree);
+    IndexT old = iFree;
+    IndexT i = nextIndex(iFree);
 
     if (i == iCallback)
       return NOSTATE;
 
-    INC_INDEX(PIN_iFree);
+    twiTrace::event(TWI_TRACE_IFREE);
     iFree = i;
 
     return &queue[old];
@@ -103,7 +333,10 @@ public:
 
   void     doneCmd() {
     //assert( validIndex(iCmd) && hasCmd() );
-    INC_INDEX(PIN_iCmd);
+  #ifdef USINGLATENCY
+    twi_latency_record(&queue[iCmd]);
+  #endif
+    twiTrace::event(TWI_TRACE_ICMD);
     iCmd = nextIndex(iCmd);
   };
 
@@ -118,7 +351,7 @@ public:
 
   void     doneCallback() {
     //assert( validIndex(iCallback) && hasCallback() );
-    INC_INDEX(PIN_iCallback);
+    twiTrace::event(TWI_TRACE_ICALLBACK);
     iCallback = nextIndex(iCallback);
   }
 
@@ -126,42 +359,113 @@ public:
     return iCallback != iCmd;
   }
 
+  // runs the donefuncs of completed commands; only for twiCallbacksPolled, where
+  // it must be called from the main loop
+  void run_callbacks() {
+    TWI_POLL_HOOK();
+
+    if (Policy::in_isr)
+      return;
+
+    while (hasCallback()) {
+      state_t &s = currCallback();
+
+      if ((callback_fp)0 != s.donefunc)
+        s.donefunc(&s);
+
+      doneCallback();
+    }
+  }
+
 private:
+  static inline void fill(state_t *p, char addr_rw, char *data, twi_len_t len, callback_fp donefunc, uint8_t flags, char addr_lo) {
+    p->buff = data;
+  #ifdef USINGINLINE
+    if ((flags & (1<<FLAG_INLINE_BIT)) && data)
+      memcpy(p->data, data, len);
+  #endif
+    p->addr = addr_rw;
+    p->len = len;
+    p->flags = flags;
+    p->addr_lo = addr_lo;
+    p->donefunc = donefunc;
+  #ifdef USINGLATENCY
+    p->t_queued = p->t_start = twiStampTimer::now();
+  #endif
+  }
+
+#ifdef USINGSINGLEPRODUCER
+  // the entry at iFree isn't seen by the ISR until iFree moves past it, so it is
+  // ours to fill with interrupts enabled
+  inline bool enqueue_rw(char addr_rw, char *data, twi_len_t len, callback_fp donefunc, uint8_t flags, char addr_lo = 0) {
+    TWI_BARRIER(); // reload iCallback, which the ISR moves
+    IndexT i = iFree;
+    IndexT next = nextIndex(i);
+
+    if (next == iCallback)
+      return false;
+
+    fill(&queue[i], addr_rw, data, len, donefunc, flags, addr_lo);
+
+    TWI_BARRIER(); // the entry must be complete before it is published
+    uint8_t sreg = SREG;
+    cli();
+    twiTrace::enqueue(addr_rw, len);
+    twiTrace::event(TWI_TRACE_IFREE);
+    iFree = next;
+    kick_isr();
+    SREG = sreg;
+
+    return true;
+  }
+
+  // note that this enables interrupts during execution
+  bool enqueue_rwb(char addr_rw, char *data, twi_len_t len, callback_fp donefunc, uint8_t flags, char addr_lo = 0) {
+    // we could initialize this to true, and assert on it being false to prevent re-entry
+    _blocking_callback_called = false;
+    _blocking_donefunc = donefunc;
+    uint8_t sreg = SREG;
+    sei();
+
+    // wait until the enqueue succeeds; with polled callbacks, slots are only freed here
+    while (!enqueue_rw(addr_rw, data, len, blocking_callback, flags, addr_lo))
+      run_callbacks();
+
+    while (!_blocking_callback_called)
+      run_callbacks();
+    SREG = sreg;
+
+    return _blocking_state & (1<<STATE_SUCCESS_BIT);
+  }
+#else
   // must be called with interrupts disabled
-  inline bool enqueue_rw_crit(char addr_rw, char *data, uint8_t len, callback_fp donefunc) {
+  inline bool enqueue_rw_crit(char addr_rw, char *data, twi_len_t len, callback_fp donefunc, uint8_t flags, char addr_lo) {
     state_t *p = allocFree();
 
     if (p == NOSTATE)
       return false;
 
-    p->buff = data;
-    p->addr = addr_rw;
-    p->len = len;
-    p->donefunc = donefunc;
+    fill(p, addr_rw, data, len, donefunc, flags, addr_lo);
+    twiTrace::enqueue(addr_rw, len);
 
     kick_isr();
 
     return true;
   }
 
-  inline bool enqueue_rw(char addr_rw, char *data, uint8_t len, callback_fp donefunc) {
+  inline bool enqueue_rw(char addr_rw, char *data, twi_len_t len, callback_fp donefunc, uint8_t flags, char addr_lo = 0) {
     uint8_t sreg = SREG;
     cli();
 
-    bool ret = enqueue_rw_crit(addr_rw, data, len, donefunc);
+    bool ret = enqueue_rw_crit(addr_rw, data, len, donefunc, flags, addr_lo);
 
     SREG = sreg;
 
     return ret;
   }
 
-  static volatile bool _blocking_callback_called;
-  static volatile char _blocking_state;
-  static callback_fp _blocking_donefunc;
-  static void blocking_callback(state_t *s);
-
   // note that this may enable interrupts during execution
-  bool enqueue_rwb(char addr_rw, char *data, uint8_t len, callback_fp donefunc) {
+  bool enqueue_rwb(char addr_rw, char *data, twi_len_t len, callback_fp donefunc, uint8_t flags, char addr_lo = 0) {
     // we could initialize this to true, and assert on it being false to prevent re-entry
     _blocking_callback_called = false;
     _blocking_donefunc = donefunc;
@@ -169,43 +473,87 @@ private:
     cli();
 
     // wait until the enqueue succeeds
-    while (!enqueue_rw_crit(addr_rw, data, len, blocking_callback)) {
+    while (!enqueue_rw_crit(addr_rw, data, len, blocking_callback, flags, addr_lo)) {
       // let TWI interrupts fire
       sei();
       // one instruction is always executed after sei(), so we cannot cli() immediately after
       asm volatile ("nop");
+      // with polled callbacks, slots are only freed here
+      run_callbacks();
       cli();
     }
 
     sei();
     while (!_blocking_callback_called)
-    {}
+      run_callbacks();
     SREG = sreg;
 
     return _blocking_state & (1<<STATE_SUCCESS_BIT);
   }
+#endif
+
+  // first address byte of 10-bit address addr
+  static inline char tenbit_addr(uint16_t addr, uint8_t rw) {
+    return TWI_TENBIT_PREFIX | ((addr >> 7) & 0x06) | (rw<<TWI_READ_BIT);
+  }
 
 public:
   // returns true if enqueue was successful, otherwise false for full TWI command buffer
-  bool enqueue_r(char addr, char *data, uint8_t len, callback_fp donefunc) {
-    return enqueue_rw((addr<<TWI_ADR_BITS) | (1<<TWI_READ_BIT), data, len, donefunc);
+  bool enqueue_r(char addr, char *data, twi_len_t len, callback_fp donefunc, uint8_t flags = 0) {
+    return enqueue_rw((addr<<TWI_ADR_BITS) | (1<<TWI_READ_BIT), data, len, donefunc, flags);
   }
 
   // returns true on TWI success, otherwise false (use donefunc for full status info)
-  bool enqueue_rb(char addr, char *data, uint8_t len, callback_fp donefunc) {
-    return enqueue_rwb((addr<<TWI_ADR_BITS) | (1<<TWI_READ_BIT), data, len, donefunc);
+  bool enqueue_rb(char addr, char *data, twi_len_t len, callback_fp donefunc, uint8_t flags = 0) {
+    return enqueue_rwb((addr<<TWI_ADR_BITS) | (1<<TWI_READ_BIT), data, len, donefunc, flags);
   }
 
   // returns true if enqueue was successful, otherwise false for full TWI command buffer
-  bool enqueue_w(char addr, char *data, uint8_t len, callback_fp donefunc) {
-    return enqueue_rw((addr<<TWI_ADR_BITS) | (0<<TWI_READ_BIT), data, len, donefunc);
+  bool enqueue_w(char addr, char *data, twi_len_t len, callback_fp donefunc, uint8_t flags = 0) {
+    return enqueue_rw((addr<<TWI_ADR_BITS) | (0<<TWI_READ_BIT), data, len, donefunc, flags);
   }
 
   // returns true on TWI success, otherwise false (use donefunc for full status info)
-  bool enqueue_wb(char addr, char *data, uint8_t len, callback_fp donefunc) {
-    return enqueue_rwb((addr<<TWI_ADR_BITS) | (0<<TWI_READ_BIT), data, len, donefunc);
+  bool enqueue_wb(char addr, char *data, twi_len_t len, callback_fp donefunc, uint8_t flags = 0) {
+    return enqueue_rwb((addr<<TWI_ADR_BITS) | (0<<TWI_READ_BIT), data, len, donefunc, flags);
   }
 
+  // 10-bit addressed versions of the above; addr is 0 - 0x3FF
+  bool enqueue_r10(uint16_t addr, char *data, twi_len_t len, callback_fp donefunc, uint8_t flags = 0) {
+    return enqueue_rw(tenbit_addr(addr, 1), data, len, donefunc, flags | (1<<FLAG_TENBIT_BIT), addr & 0xFF);
+  }
+
+  bool enqueue_rb10(uint16_t addr, char *data, twi_len_t len, callback_fp donefunc, uint8_t flags = 0) {
+    return enqueue_rwb(tenbit_addr(addr, 1), data, len, donefunc, flags | (1<<FLAG_TENBIT_BIT), addr & 0xFF);
+  }
+
+  bool enqueue_w10(uint16_t addr, char *data, twi_len_t len, callback_fp donefunc, uint8_t flags = 0) {
+    return enqueue_rw(tenbit_addr(addr, 0), data, len, donefunc, flags | (1<<FLAG_TENBIT_BIT), addr & 0xFF);
+  }
+
+  bool enqueue_wb10(uint16_t addr, char *data, twi_len_t len, callback_fp donefunc, uint8_t flags = 0) {
+    return enqueue_rwb(tenbit_addr(addr, 0), data, len, donefunc, flags | (1<<FLAG_TENBIT_BIT), addr & 0xFF);
+  }
+
+#ifdef USINGINLINE
+  // copies the len <= TWI_INLINE_LEN bytes at data into the queue entry, so data
+  // can go out of scope as soon as this returns
+  // returns true if enqueue was successful, otherwise false for full TWI command buffer or len too big
+  bool enqueue_w_inline(char addr, const char *data, uint8_t len, callback_fp donefunc, uint8_t flags = 0) {
+    if (len > TWI_INLINE_LEN)
+      return false;
+    return enqueue_rw((addr<<TWI_ADR_BITS) | (0<<TWI_READ_BIT), (char*)data, len, donefunc, flags | (1<<FLAG_INLINE_BIT));
+  }
+
+  // reads len <= TWI_INLINE_LEN bytes into the queue entry; donefunc finds them
+  // at state_data(s), and must copy them out before returning
+  bool enqueue_r_inline(char addr, uint8_t len, callback_fp donefunc, uint8_t flags = 0) {
+    if (len > TWI_INLINE_LEN)
+      return false;
+    return enqueue_rw((addr<<TWI_ADR_BITS) | (1<<TWI_READ_BIT), NULL, len, donefunc, flags | (1<<FLAG_INLINE_BIT));
+  }
+#endif
+
   // returns true if enqueue was successful, otherwise false for full TWI command buffer
   bool enqueue_nop(callback_fp donefunc) {
     uint8_t sreg = SREG;
@@ -218,14 +566,14 @@ public:
       return false;
     }
 
-    p->len = 0;
-    p->donefunc = donefunc;
+    // all of it, or a quick command's flags left in the entry would be sent
+    fill(p, 0, NULL, 0, donefunc, 0, 0);
 
     // need to do something like kick_isr() here, except that initiates a TWI START condition
 
     sei();
     while (!_blocking_callback_called)
-    {}
+      run_callbacks();
     SREG = sreg;
 
     return true;
@@ -245,42 +593,43 @@ public:
     uint8_t sreg = SREG;
     sei();
     while (!_blocking_callback_called)
-    {}
+      run_callbacks();
     SREG = sreg;
   }
 };
 
+typedef twiQueueT<TWI_QUEUE_SIZE, TWI_QUEUE_INDEX, TWI_QUEUE_POLICY> twiQueue;
+
 extern twiQueue twiQ;
 
-static void i2c_master_initialize(void) {
+static inline void i2c_master_initialize(void) {
   TWBR = TWI_TWBR;                        // baud rate
-  TWSR &= ~((1<<TWPS1) | (1<<TWPS0));     // ensure there is no baud rate prescalar
+  TWSR = (TWSR & ~((1<<TWPS1) | (1<<TWPS0))) | TWI_TWPS; // baud rate prescalar
   //TWDR = 0xFF;                            // default content = SDA released
   TWCR = (1<<TWEN)|                       // enable TWI interface and release TWI pins
          (0<<TWIE)|(0<<TWINT)|            // disable interupt
          (0<<TWEA)|(0<<TWSTA)|(0<<TWSTO)| // don't actually start anything
          (0<<TWWC);
   
-  // from datasheet: SCL frequency = F_CPU / (16+2(TWBR)*4**(TWPS))
   // max freq is 400kHz, and we should probably allow for 16 clocks to be safe
-  // (noting that this limits how long TWISlaveMem14's TWIUserSignal(...) can take)
-  // 16MHz / 40 == 400kHz, which means we need a prescaler of 40 * 16 = 640 for the timer
-  // to be 1 clock before timeout. But that's actually bad, as outlined in the "Prescalar 
-  // Reset" section of the datasheet. Instead, we want to max out how high the timer will
-  // count. If using a 16-bit timer, we'll want to allow up to 640 * 4 (allowing for 
-  // 100kHz I2C freq), which means we can run with no prescaler. If using an 8-bit timer,
-  // we'd have to at least use the /8 option.
+  // (noting that this limits how long TWISlaveMem14's TWIUserSignal(...) can take).
+  // Rather than a prescaler that makes the timer count SCL clocks (which is bad, as
+  // outlined in the "Prescalar Reset" section of the datasheet), twiTimer uses the
+  // smallest prescaler that fits TWI_TIMEOUT_CYCLES: none on a 16-bit timer at
+  // 100-400kHz, /8 or more on an 8-bit one.
   
   #ifdef USINGTIMER
-  DDRL |= (1<<PL3);     // for debugging
-  TCCR5A = (1<<COM5A0); // for debugging
-  TCCR5B = (1<<WGM52) | (1<<CS50);
-  TIMSK5 = 0;
-  TIFR5 = 0xFF;
-  // the + 1 is to avoid any possible problem if a nonzero prescaler is used above
-  //                           this formula is from the datasheet, with TWPS = 0
-  //       vvvvvvvvvvvvvvvvvvv (F_CPU is omitted because it is a common factor)
-  OCR5A = ((16 + 2 * TWI_TWBR) * TIMEOUT_TWI_CLOCKS) + 1;
+  twiTimer::init();
+  #endif
+  #ifdef TWI_USINGSTAMPS
+  twiStampTimer::init();
+  #endif
+  #ifdef USINGLATENCY
+  twi_latency_clear(0xFF);
+  #endif
+  #ifdef USINGBUSLOAD
+  twi_busload_clear();
+  twiStampTimer::overflow_interrupt();
   #endif
 }
 
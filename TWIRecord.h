@@ -0,0 +1,77 @@
+#ifndef TWIRecord_h
+#define TWIRecord_h
+
+#include <stdint.h>
+#include <avr/io.h>
+
+/* twiTraceRecord, a TWI_TRACE backend (needs USINGRECORD in TWIMaster.h).
+
+   It keeps the last TWI_RECORD_LEN TWSR transitions, timeouts and enqueues in
+   RAM, stamped with TWI_STAMP_TIMER, so that a fault in the field can be dumped
+   (twi_serial_bridge's 'r' command) and fed back through TWIMaster.cpp on a PC
+   by example/host_sim/twi_replay. Use it alone (-DTWI_TRACE=twiTraceRecord) or
+   alongside another backend with twiTraceTee.
+
+   Recording stops while paused is set, so a dump can be read out consistently.
+*/
+
+typedef struct {
+  uint8_t code; // TWSR & TWSR_STATUS_MASK on entry to the TWI ISR (low 3 bits clear),
+                // or TWI_TRACE_CODE(TWI_TRACE_TIMEOUT or TWI_TRACE_ENQUEUE)
+  uint8_t data; // TWDR on entry to the TWI ISR, or the SLA+R/W enqueued
+  uint8_t len;  // the length enqueued (its low 8 bits)
+  uint16_t t;   // twiStampTimer::now()
+} twi_record_t;
+
+template <uint8_t Len>
+struct twiTraceRecordT {
+  typedef char check_len[(Len & (Len - 1)) == 0 ? 1 : -1];
+
+  // the oldest record is ring[head] if wrapped, otherwise ring[0]
+  static twi_record_t ring[Len];
+  static volatile uint8_t head;
+  static volatile bool wrapped;
+  static volatile bool paused;
+
+  // called with interrupts disabled
+  static inline void log(uint8_t code, uint8_t data, uint8_t len) {
+    if (paused)
+      return;
+
+    twi_record_t *r = &ring[head];
+    r->code = code;
+    r->data = data;
+    r->len = len;
+    r->t = twiStampTimer::now();
+
+    head = (head + 1) & (Len - 1);
+    if (head == 0)
+      wrapped = true;
+  }
+
+  // the rest of the events follow from the TWSR sequence on replay
+  static inline void event(uint8_t e) {
+    if (e == TWI_TRACE_TIMEOUT)
+      log(TWI_TRACE_CODE(e), 0, 0);
+  }
+  static inline void isr_enter(uint8_t twsr) { log(twsr, TWDR, 0); }
+  static inline void isr_exit() {}
+  static inline void enqueue(uint8_t addr_rw, uint8_t len) { log(TWI_TRACE_CODE(TWI_TRACE_ENQUEUE), addr_rw, len); }
+
+  static void clear() {
+    uint8_t sreg = SREG;
+    cli();
+    head = 0;
+    wrapped = false;
+    SREG = sreg;
+  }
+};
+
+template <uint8_t Len> twi_record_t twiTraceRecordT<Len>::ring[Len];
+template <uint8_t Len> volatile uint8_t twiTraceRecordT<Len>::head;
+template <uint8_t Len> volatile bool twiTraceRecordT<Len>::wrapped;
+template <uint8_t Len> volatile bool twiTraceRecordT<Len>::paused;
+
+typedef twiTraceRecordT<TWI_RECORD_LEN> twiTraceRecord;
+
+#endif // #ifndef TWIRecord_h
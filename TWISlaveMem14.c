@@ -6,9 +6,123 @@
 #include <util/twi.h>
 #include <avr/io.h>
 
+// Uncomment to check SMBus packet error codes; see the comment above ISR(TWI_vect)
+//#define USINGPEC
+
+#ifdef USINGPEC
+#include "TWICrc8.h"
+#endif
+
+// Uncomment to queue TWIUserError/TWIUserSignal calls from the ISR and deliver
+// them from poll_user_events() in the main loop, so that slow handlers do not
+// hold SCL low. A handler that is known to be short can stay synchronous by
+// also defining TWI_BOUNDED_ERROR and/or TWI_BOUNDED_SIGNAL.
+//#define USINGDEFER
+
+// Uncomment to serve read-only regions straight from flash or EEPROM; see setup_regions(...)
+//#define USINGREGIONS
+
+// Uncomment for automatic address assignment over general call (needs USINGDEFER); see setup_arp(...)
+//#define USINGARP
+
+#if defined(USINGARP) && !defined(USINGDEFER)
+#error "USINGARP needs USINGDEFER: the assigned address is stored in EEPROM from poll_user_events()"
+#endif
+
+#if defined(USINGREGIONS) || defined(USINGARP)
+#include <avr/eeprom.h>
+#endif
+
 extern void TWIUserError( uint8_t );
 extern void TWIUserSignal( uint8_t );
 
+#ifdef USINGDEFER
+/*
+ Event ring, written only by the ISR and read only by poll_user_events();
+ 8-bit indices are read and written atomically, so neither side needs cli().
+ size is 2^NEVBits, with max useful size of 2^NEVBits - 1
+ 19 bytes used.
+*/
+#define NEVBits 3
+#define EV_SIGNAL 0
+#define EV_ERROR  1
+#define EV_ARP    2 // store the address assigned by USINGARP
+
+typedef struct {
+  uint8_t type;
+  uint8_t v;
+} twi_event_t;
+
+// as in TWIMaster.h: stops the compiler moving memory accesses across it
+#ifndef TWI_BARRIER
+#define TWI_BARRIER() asm volatile ("" ::: "memory")
+#endif
+
+#ifdef USINGARP
+static void arp_store(uint8_t a);
+#endif
+
+static twi_event_t events[1<<NEVBits];
+static volatile uint8_t ev_head, ev_tail;
+volatile uint8_t twi_events_lost; // events dropped because the ring was full
+
+static inline void post_event(uint8_t type, uint8_t v) {
+  uint8_t h = ev_head;
+  uint8_t n = (h + 1) & ((1<<NEVBits) - 1);
+
+  if (n == ev_tail) {
+    twi_events_lost++;
+    return;
+  }
+
+  events[h].type = type;
+  events[h].v = v;
+  TWI_BARRIER(); // the entry must be complete before it is published
+  ev_head = n;
+}
+
+// Call from the main loop. Returns the number of events delivered.
+uint8_t poll_user_events() {
+  uint8_t count = 0;
+
+  while (ev_tail != ev_head) {
+    twi_event_t *e = &events[ev_tail];
+
+    TWI_BARRIER(); // ... and only read after it was published
+
+    if (e->type == EV_SIGNAL)
+      TWIUserSignal(e->v);
+#ifdef USINGARP
+    else if (e->type == EV_ARP)
+      arp_store(e->v);
+#endif
+    else
+      TWIUserError(e->v);
+
+    ev_tail = (ev_tail + 1) & ((1<<NEVBits) - 1);
+    count++;
+  }
+
+  return count;
+}
+#endif
+
+static inline void user_error(uint8_t e) {
+#if defined(USINGDEFER) && !defined(TWI_BOUNDED_ERROR)
+  post_event(EV_ERROR, e);
+#else
+  TWIUserError(e);
+#endif
+}
+
+static inline void user_signal(uint8_t sig) {
+#if defined(USINGDEFER) && !defined(TWI_BOUNDED_SIGNAL)
+  post_event(EV_SIGNAL, sig);
+#else
+  TWIUserSignal(sig);
+#endif
+}
+
 /* TWI init_ support functions.
 */
 static inline void init_start() {
@@ -60,6 +174,11 @@ uint8_t *twiStore ;
 int  read_len;
 int  write_len;
 
+#ifdef TWAMR
+uint8_t bank_mask; // 0 when there is a single device; see setup_banks(...)
+#endif
+
+// A single device; this also undoes an earlier setup_banks(...)
 void setup(uint8_t addr, uint8_t* bs, int rlen, int wlen) {
   twiStore = bs;
   read_len  = rlen;
@@ -68,84 +187,488 @@ void setup(uint8_t addr, uint8_t* bs, int rlen, int wlen) {
   TWAR = addr << 1;
 #ifdef TWAMR
   TWAMR &= (1 << 0); // ensure there is no mask
+  bank_mask = 0;
 #endif
 //  TWDR = 0x00;                                      // Default content = SDA released.
   init_ack();
 }
+
+#ifdef TWAMR
+/*
+ Virtual devices: one register bank per TWI address.
+ 3 more bytes used for setup.
+*/
+typedef struct {
+  uint8_t *store;
+  int read_len;
+  int write_len;
+} twi_bank_t;
+
+const twi_bank_t *twiBanks;
+
+// Answers on nbanks consecutive addresses starting at addr, with nbanks a power
+// of two (up to 128) and addr a multiple of nbanks. Address addr + n reads and
+// writes banks[n], e.g. a sensor at 0x50 and an EEPROM at 0x51 with nbanks == 2.
+void setup_banks(uint8_t addr, const twi_bank_t *banks, uint8_t nbanks) {
+  twiBanks = banks;
+  setup(addr, banks[0].store, banks[0].read_len, banks[0].write_len);
+  bank_mask = nbanks - 1;
+  TWAMR = bank_mask << 1; // ignore the low address bits when matching
+}
+
+// TWDR holds the SLA+R/W we just ACKed
+static inline void select_bank() {
+  if (bank_mask) {
+    const twi_bank_t *b = &twiBanks[(TWDR >> 1) & bank_mask];
+    twiStore = b->store;
+    read_len  = b->read_len;
+    write_len = b->write_len;
+  }
+}
+#else
+static inline void select_bank() {}
+#endif
+
+/*
+ Change counters: the register file is split into blocks of 2^gen_shift bytes
+ and gen[b] is bumped whenever store_write(...) changes block b. gen normally
+ lives in the readable register file, so a master reads the counters first and
+ then only the blocks whose counter moved (see twi_mem14_sync in TWIHelper.h).
+ Only for the single device setup(...).
+ 3 bytes used for setup.
+*/
+uint8_t *twiGen;
+uint8_t gen_shift;
+
+void setup_changes(uint8_t *gen, uint8_t shift) {
+  twiGen = gen;
+  gen_shift = shift;
+}
+
+// Copies len bytes to twiStore[addr] with interrupts disabled, so that a master
+// never reads a half written value, and bumps the counter of every block whose
+// contents actually changed.
+void store_write(int addr, const uint8_t *src, uint8_t len) {
+  uint8_t sreg = SREG;
+  cli();
+
+  uint8_t *p = &twiStore[addr];
+  int end = addr + len;
+  uint8_t changed = 0;
+
+  for (; addr < end; addr++) {
+    changed |= *p ^ *src;
+    *p++ = *src++;
+
+    // last byte of a block, or of the write
+    if ( ((addr + 1) & ((1 << gen_shift) - 1)) == 0 || addr + 1 == end ) {
+      if (changed)
+        twiGen[addr >> gen_shift]++;
+      changed = 0;
+    }
+  }
+
+  SREG = sreg;
+}
+
+/*
+ General call "latch now": every slave on the bus snapshots its telemetry at
+ the same instant, and the master then reads the copies at leisure.
+ 5 bytes used for setup.
+*/
+#define TWI_GCALL_LATCH 0x4C // not one of the I2C-defined general call commands (0x04, 0x06)
+
+uint8_t *latch_src;
+uint8_t *latch_dst;
+uint8_t  latch_len;
+
+// Call after setup(...). Enables the general call address; a general call
+// carrying TWI_GCALL_LATCH copies len bytes from src to dst (normally part of
+// the readable register file). Multi-byte values in src should be updated
+// with interrupts disabled.
+void setup_latch(uint8_t *src, uint8_t *dst, uint8_t len) {
+  latch_src = src;
+  latch_dst = dst;
+  latch_len = len;
+
+  TWAR |= (1<<TWGCE);
+}
+
+#ifdef USINGARP
+/*
+ Automatic address assignment for fleets of identical nodes. A node whose
+ EEPROM holds no address listens only to the general call. The master finds
+ the unassigned nodes' unique IDs by a binary search on UID prefixes:
+   TWI_GCALL_ARP_PREFIX nbits prefix...  unassigned nodes whose UID starts with
+                                         the nbits given (MSB first) answer at
+                                         TWI_ARP_ADDRESS; the others stop
+   TWI_GCALL_ARP_ASSIGN addr uid...      the node with this UID takes addr and
+                                         stores it in EEPROM
+ Several nodes can ACK TWI_ARP_ADDRESS at once, so a probe there (a quick
+ write) tells the master whether any node has the prefix. See
+ twi_arp_enumerate in TWIHelper.h. The new address is written to EEPROM from
+ poll_user_events(), not the ISR, so USINGARP needs USINGDEFER.
+ 6 bytes used for setup and state.
+*/
+#define TWI_UID_LEN 4
+#define TWI_ARP_ADDRESS 0x61      // the SMBus ARP default address
+#define TWI_GCALL_ARP_PREFIX 0x4E // even, as an odd command marks a hardware general call
+#define TWI_GCALL_ARP_ASSIGN 0x50
+
+const uint8_t *arp_uid;
+uint8_t *arp_ee;          // EEPROM byte holding our address, 0xFF if unassigned
+static uint8_t arp_match; // the UID still matches the command so far
+static uint8_t arp_n;     // ARP_PREFIX: bits still to compare
+
+static inline uint8_t arp_assigned() {
+  return (TWAR >> 1) != 0 && (TWAR >> 1) != TWI_ARP_ADDRESS;
+}
+
+// Call after setup(...), whose address is replaced by the one in EEPROM, if
+// any. uid is TWI_UID_LEN bytes unique to this node (e.g. a serial number).
+void setup_arp(const uint8_t *uid, uint8_t *ee_addr) {
+  uint8_t a = eeprom_read_byte(ee_addr);
+
+  arp_uid = uid;
+  arp_ee = ee_addr;
+  TWAR = ((a < 0x78 ? a : 0) << 1) | (1<<TWGCE);
+}
+
+// from poll_user_events(): an EEPROM write takes milliseconds, far too long for
+// the ISR
+static void arp_store(uint8_t a) {
+  eeprom_update_byte(arp_ee, a);
+}
+
+// byte k of a general call ARP command
+static inline void arp_byte(uint8_t cmd, uint8_t k, uint8_t c) {
+  if (arp_assigned())
+    return;
+
+  if (cmd == TWI_GCALL_ARP_PREFIX) {
+    if (k == 1) {
+      arp_n = c;
+      arp_match = 1;
+    } else if (arp_n > 0) {
+      uint8_t bits = arp_n < 8 ? arp_n : 8;
+      uint8_t m = (uint8_t)(0xFF00 >> bits);
+
+      if ((c ^ arp_uid[k - 2]) & m)
+        arp_match = 0;
+      arp_n -= bits;
+    }
+
+    // the whole prefix is in
+    if (arp_n == 0)
+      TWAR = ((arp_match ? TWI_ARP_ADDRESS : 0) << 1) | (1<<TWGCE);
+  } else {
+    if (k == 1) {
+      arp_n = c;
+      arp_match = 1;
+    } else if (k < 2 + TWI_UID_LEN) {
+      if (c != arp_uid[k - 2])
+        arp_match = 0;
+
+      // (ignoring addresses the master must not hand out)
+      if (k == 1 + TWI_UID_LEN && arp_match &&
+          arp_n >= 0x08 && arp_n < 0x78 && arp_n != TWI_ARP_ADDRESS) {
+        post_event(EV_ARP, arp_n);
+        TWAR = (arp_n << 1) | (1<<TWGCE);
+      }
+    }
+  }
+}
+#endif
+
+static uint8_t gcall_cmd; // first byte of the current general call
+static uint8_t gcall_k;   // index of the next byte
+
+static inline void gcall_command(uint8_t c) {
+  uint8_t k = gcall_k++;
+
+  if (k == 0)
+    gcall_cmd = c;
+
+  switch (gcall_cmd) {
+    case TWI_GCALL_LATCH: {
+      uint8_t *p = latch_src, *q = latch_dst;
+      uint8_t n = latch_len;
+
+      if (k != 0)
+        break;
+      while (n--)
+        *q++ = *p++;
+      break;
+    }
+#ifdef USINGARP
+    case TWI_GCALL_ARP_PREFIX:
+    case TWI_GCALL_ARP_ASSIGN:
+      if (k != 0)
+        arp_byte(gcall_cmd, k, c);
+      break;
+#endif
+  }
+}
+
 #define D8 /8
 
 // N.B. prog_uchar from <avr/pgmspace.h> does not work, as the PROGMEM attribute gets lost from the typedef
 const unsigned char PROGMEM mm[] = { 0,1,3,7 };
 
-ISR(TWI_vect) {
-  PORTB |= (1<<PB2);
-  TCNT2 = 0;
-  SPDR = TWSR;
-  /* 11 bytes used for local infunction state
-   */
-  static int16_t i;
-  static addr_t buff;
-  static uint8_t mask;
+/* 11 bytes used for ISR state
+ */
+static int16_t i;
+static addr_t buff;
+static uint8_t mask;
+
+// i is just past the end of a fully received group
+static inline void flush_group() {
+  uint8_t *p, *q;
+  p = &twiStore[i]; // passed end of reg block
+  q = &buff.c[(mask+1)];  // passwd end of cache
+
+  if (mask > 1) {
+    *--p = *--q;
+    *--p = *--q;
+  }
+  if (mask > 3) {
+    *--p = *--q;
+    *--p = *--q;
+    *--p = *--q;
+    *--p = *--q;
+  }
+
+  // mask >= 1
+  *--p = *--q;
+  *--p = *--q;
+}
+
+#ifdef USINGREGIONS
+/*
+ Read-only regions: Mem14 addresses past read_len can be backed by flash or
+ EEPROM, so constant tables (calibration curves, descriptors) don't have to
+ be copied into twiStore. Grouped reads prefetch the whole group into buff at
+ the group's first byte, so the remaining bytes cost the same as SRAM ones.
+ Flash data must be in the low 64K (pgm_read_byte); an EEPROM read stalls
+ while the application is writing the EEPROM.
+ 3 bytes used for setup, 2 for ISR state.
+*/
+#define REGION_FLASH  0
+#define REGION_EEPROM 1
+
+typedef struct {
+  uint16_t start; // first Mem14 address
+  uint16_t len;
+  uint8_t  type;  // REGION_FLASH or REGION_EEPROM
+  const uint8_t *data;
+} twi_region_t;
+
+const twi_region_t *twiRegions;
+uint8_t nregions;
+
+static const twi_region_t *rgn; // the region last read from
+
+void setup_regions(const twi_region_t *regions, uint8_t n) {
+  twiRegions = regions;
+  nregions = n;
+  rgn = 0;
+}
+
+// returns 0 outside every region
+static uint8_t region_byte(uint16_t a) {
+  if (!rgn || a < rgn->start || a - rgn->start >= rgn->len) {
+    uint8_t k;
+
+    rgn = 0;
+    for (k = 0; k < nregions; k++)
+      if (a >= twiRegions[k].start && a - twiRegions[k].start < twiRegions[k].len) {
+        rgn = &twiRegions[k];
+        break;
+      }
+    if (!rgn)
+      return 0;
+  }
+
+  if (rgn->type == REGION_FLASH)
+    return pgm_read_byte(rgn->data + (a - rgn->start));
+  else
+    return eeprom_read_byte(rgn->data + (a - rgn->start));
+}
+
+// i is at the start of a group
+static inline void fill_region_group() {
+  uint8_t k;
+
+  for (k = 0; k <= mask; k++)
+    buff.c[k] = region_byte(i + k);
+}
+#endif
+
+#ifdef USINGPEC
+/*
+ With USINGPEC transfers are framed as in SMBus, with one PEC at the end:
+
+ - A write that carries anything after the two address bytes ends with its
+   PEC. As the slave can't tell which byte is the last, each byte is held back
+   until the next one (or the STOP) shows it was not the PEC, and the last
+   group of a grouped write is only stored if the PEC matches (TWIUserError(3)
+   otherwise); so a single-group write is stored whole or not at all, while
+   the earlier groups of a longer write are stored as they complete.
+ - A write of just the address has no PEC of its own; a read straight after it
+   continues its PEC, so the PEC of the read also covers the address it reads
+   from (as in SMBus "read word", where it covers the command). That is so
+   whether a repeated START or a STOP comes between them, as the slave sees
+   both as TW_SR_STOP; TWIMaster.cpp follows the same rule. A read after
+   anything else (or after a bus error), and a write, start a fresh PEC at
+   their SLA.
+ - A grouped read sends its PEC after the group: like an SMBus command, the
+   group fixes the length of the read. Reading on past the PEC returns the
+   following bytes with no further PEC. Ungrouped (mask == 0) reads are not
+   checked, as their length is up to the master.
+ 6 bytes used for PEC state.
+*/
+static uint8_t pec;
+static uint8_t pec_byte;  // the byte held back, which may be the write's PEC
+static uint8_t pec_held;  // pec_byte is set
+static uint8_t pec_flush; // the group in buff is complete, but not yet stored
+static uint8_t pec_cont;  // the last transfer was a write of just the address
+static uint8_t pec_due;   // reads: 1 if the next byte is the PEC, 2 once it was sent
+#endif
+
+// a data byte of a write (the two address bytes first); returns 0 if the
+// next byte must be NACKed
+static inline uint8_t write_byte(uint8_t c) {
+#ifdef USINGPEC
+  // c is not the PEC, so neither was the last byte of the group before it
+  if (pec_flush) {
+    pec_flush = 0;
+    flush_group();
+  }
+#endif
+  if (i < write_len) {
+    if (0 == mask)
+      twiStore[i++] = c;
+    else {
+      buff.c[i++ & mask] = c;
+
+      if (0 == i) {
+        if ((buff.i | 0x7) == 0xffff)
+          user_signal( (uint8_t)(buff.i & 0x7));
+        else {
+          i = buff.i & 0x3fff;
+
+          mask = pgm_read_byte (&mm[ buff.c[1] / 0x40 ]);
+          if ( (i & mask) != 0) {
+            user_error(1);
+            return 0; // Starting address not properly aligned.
+          }
+        }
+      } else if ( 0 == (i & mask) ) {
+#ifdef USINGPEC
+        pec_flush = 1;
+#else
+        flush_group();
+#endif
+      }
+    }
+  }
+  return 1;
+}
+
+#ifdef USINGPEC
+// a write or general call begins with its SLA; nothing carries over from
+// before it
+static inline void pec_start(uint8_t sla) {
+  pec = crc8(0, sla);
+  pec_held = 0;
+  pec_flush = 0;
+  pec_cont = 0;
+}
+
+// STOP or repeated START after a write: the byte held back is its PEC, unless
+// the write was just the address
+static inline void pec_end_write() {
+  if (!pec_held)
+    return;
+  pec_held = 0;
+
+  if (i < 0) {
+    write_byte(pec_byte);
+    pec_cont = 1;
+    return;
+  }
+
+  if (pec == 0) {
+    if (pec_flush)
+      flush_group();
+  } else
+    user_error(3);
+  pec_flush = 0;
+}
+#endif
+
+// The slave state machine. Normally called from our own ISR(TWI_vect); with
+// TWI_DUAL_ROLE defined, TWIMaster.cpp (with USINGSLAVE) owns the ISR instead
+// and calls this for the slave states.
+void twi_slave_isr(void) {
+  uint8_t d;
 
   switch (TWSR D8) {
     // we just ACKed our address; note that TWDR will contain SLA+W
-    // (we would care about reading TWDR if TWAMR != 0b0000 000x)
+    // (which picks the bank if TWAMR != 0b0000 000x). With TWI_DUAL_ROLE that
+    // can also happen just after losing arbitration as a master.
     case TW_SR_SLA_ACK D8:
+    case TW_SR_ARB_LOST_SLA_ACK D8:
+      select_bank();
+#ifdef USINGPEC
+      pec_start(TWDR);
+#endif
       i = -2;
       mask = 1;
       init_ack();
       break;
 
     case TW_SR_DATA_ACK D8:
-      if (i < write_len) {
-        if (0 == mask)
-          twiStore[i++] = TWDR;
-        else {
-          buff.c[i++ & mask] = TWDR;
-
-          if (0 == i) {
-            if ((buff.i | 0x7) == 0xffff)
-              TWIUserSignal( (uint8_t)(buff.i & 0x7));
-            else {
-              i = buff.i & 0x3fff;
-
-              mask = pgm_read_byte (&mm[ buff.c[1] / 0x40 ]);
-              if ( (i & mask) != 0) {
-                TWIUserError(1);
-                init_nack(); // Starting address not properly aligned.
-                break;       // Ugly!
-              }
-            }
-          } else if ( 0 == (i & mask) ) {
-            uint8_t *p, *q;
-            p = &twiStore[i]; // passed end of reg block
-            q = &buff.c[(mask+1)];  // passwd end of cache
-
-            if (mask > 1) {
-              *--p = *--q;
-              *--p = *--q;
-            }
-            if (mask > 3) {
-              *--p = *--q;
-              *--p = *--q;
-              *--p = *--q;
-              *--p = *--q;
-            }
-
-            // mask >= 1
-            *--p = *--q;
-            *--p = *--q;
-          }
-        }
+#ifdef USINGPEC
+      // hold each byte back until the next one shows it is not the PEC
+      pec = crc8(pec, TWDR);
+      d = pec_byte;
+      pec_byte = TWDR;
+      if (!pec_held) {
+        pec_held = 1;
+        init_ack();
+        break;
       }
-      init_ack();
+#else
+      d = TWDR;
+#endif
+      if (write_byte(d))
+        init_ack();
+      else
+        init_nack();
       break;
 
     case TW_ST_SLA_ACK D8:
+    case TW_ST_ARB_LOST_SLA_ACK D8:
+      select_bank();
+#ifdef USINGPEC
+      pec = crc8(pec_cont ? pec : 0, TWDR);
+      pec_due = 0;
+      pec_cont = 0;
+#endif
+      // fall through
     case TW_ST_DATA_ACK D8:
+#ifdef USINGPEC
+      if (pec_due == 1) {
+        pec_due = 2;
+        TWDR = pec;
+        init_ack();
+        break;
+      }
+#endif
       if ( i >=0 && i < read_len) {
         if (0 == mask)
-          TWDR = twiStore[i++] ;
+          d = twiStore[i++] ;
         else {
           if (0 == (i & mask)) {
             uint8_t *p, *q;
@@ -167,39 +690,92 @@ ISR(TWI_vect) {
               p[7] = q[7];
             }
           }
-          TWDR = buff.c[i++ & mask];
+          d = buff.c[i++ & mask];
+#ifdef USINGPEC
+          if (0 == (i & mask) && !pec_due)
+            pec_due = 1;
+#endif
         }
-      } else
-        TWDR = 0;
+      }
+#ifdef USINGREGIONS
+      else if ( i >= 0 ) {
+        if (0 == mask)
+          d = region_byte(i++);
+        else {
+          if (0 == (i & mask))
+            fill_region_group();
+          d = buff.c[i++ & mask];
+#ifdef USINGPEC
+          if (0 == (i & mask) && !pec_due)
+            pec_due = 1;
+#endif
+        }
+      }
+#endif
+      else
+        d = 0;
+
+      TWDR = d;
+#ifdef USINGPEC
+      pec = crc8(pec, d);
+#endif
 
       // just fall through
       //init_ack();
       //break;
 
     case TW_ST_DATA_NACK D8:
+      init_ack();
+      break;
+
     case TW_SR_STOP D8:
+#ifdef USINGPEC
+      pec_end_write();
+#endif
+      init_ack();
+      break;
+
+    // general call; the data byte is a command for every slave at once
+    case TW_SR_GCALL_ACK D8:
+    case TW_SR_ARB_LOST_GCALL_ACK D8:
+#ifdef USINGPEC
+      pec_start(TWDR);
+#endif
+      gcall_k = 0;
+      init_ack();
+      break;
+
+    case TW_SR_GCALL_DATA_ACK D8:
+      gcall_command(TWDR);
       init_ack();
       break;
 
     case TW_BUS_ERROR D8:
+#ifdef USINGPEC
+      pec_cont = 0;
+#endif
       init_clear_bus_error();
       break;
-    case TW_SR_ARB_LOST_SLA_ACK D8:
-    case TW_SR_ARB_LOST_GCALL_ACK D8:
     case TW_SR_DATA_NACK D8:
     case TW_SR_GCALL_DATA_NACK  D8:
-    case TW_ST_ARB_LOST_SLA_ACK D8:
     /*case TW_ST_DATA_ACK_LAST_BYTE  D8:*/
     /*case TW_ST_LAST_DATA  D8:*/
     //last_error = TWSR;
-      TWIUserError( TWSR );
+      user_error( TWSR );
       // break;
 
-    /*case TW_SR_GCALL_ACK:
-      case TW_SR_GCALL_DATA_ACK*/
     default:
       init_nack();
       break;
   }
+}
+
+#ifndef TWI_DUAL_ROLE
+ISR(TWI_vect) {
+  PORTB |= (1<<PB2);
+  TCNT2 = 0;
+  SPDR = TWSR;
+  twi_slave_isr();
   PORTB &= ~(1<<PB2);
 }
+#endif
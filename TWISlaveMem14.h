@@ -0,0 +1,246 @@
+#ifndef TWISlaveMem14_h
+#define TWISlaveMem14_h
+
+#include <stdint.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+#include <util/twi.h>
+
+/* Header-only version of TWISlaveMem14.c.
+
+   The register file, its bounds and the permitted group sizes are template
+   parameters instead of globals, so the ISR compares against constants and the
+   unused group copies are compiled out. TWIUserError/TWIUserSignal are replaced
+   by a Hooks class with static member functions; Mem14NoHooks makes them vanish.
+
+   Usage:
+     struct MyHooks {
+       static inline void error(uint8_t e)  { ... }
+       static inline void signal(uint8_t s) { ... }
+     };
+     typedef Mem14Slave<64, 16, 8, MyHooks> slave;  // 64 readable, first 16 writable
+
+     ISR(TWI_vect) { slave::isr(); }
+     ...
+     slave::setup(0x50);
+     slave::store[0] = 42;
+*/
+
+struct Mem14NoHooks {
+  static inline void error(uint8_t) {}
+  static inline void signal(uint8_t) {}
+};
+
+// picks the index type: 8 bits is enough for small register files, and the
+// AVR does 8-bit compares/increments in a single instruction
+template <bool Small> struct mem14_index { typedef int16_t type; };
+template <> struct mem14_index<true> { typedef int8_t type; };
+
+// N.B. prog_uchar from <avr/pgmspace.h> does not work, as the PROGMEM attribute gets lost from the typedef
+static const unsigned char PROGMEM mem14_group_mask[] = { 0,1,3,7 };
+
+template <uint16_t Size, uint16_t WriteLen = Size, uint8_t MaxGroup = 8, class Hooks = Mem14NoHooks>
+class Mem14Slave {
+  // MaxGroup must be one of the group sizes the address encoding can ask for
+  typedef char check_max_group[(MaxGroup == 2 || MaxGroup == 4 || MaxGroup == 8) ? 1 : -1];
+  typedef char check_write_len[(WriteLen <= Size && Size <= 0x4000) ? 1 : -1];
+
+  typedef typename mem14_index<(Size < 0x80)>::type index_t;
+
+  typedef union {
+    uint8_t c[MaxGroup];
+    uint16_t i;
+  } addr_t;
+
+  static index_t i;
+  static addr_t buff;
+  static uint8_t mask;
+
+  static inline void init_clear_bus_error() {
+    TWCR = (1<<TWEN)|                                 // TWI Interface enabled
+           (1<<TWIE)|(1<<TWINT)|                      // Enable TWI Interupt and clear the flag to read next byte
+           (1<<TWEA)|(0<<TWSTA)|(1<<TWSTO)|           // Send ACK after reception
+           (0<<TWWC);
+  }
+
+  static inline void init_ack() {
+    TWCR = (1<<TWEN)|                                 // TWI Interface enabled
+           (1<<TWIE)|(1<<TWINT)|                      // Enable TWI Interupt and clear the flag to read next byte
+           (1<<TWEA)|(0<<TWSTA)|(0<<TWSTO)|           // Send ACK after reception
+           (0<<TWWC);
+  }
+
+  static inline void init_nack() {
+    TWCR = (1<<TWEN)|                                 // TWI Interface enabled
+           (1<<TWIE)|(1<<TWINT)|                      // Enable TWI Interupt and clear the flag to read next byte
+           (0<<TWEA)|(0<<TWSTA)|(0<<TWSTO)|
+           (0<<TWWC);
+  }
+
+  // the address bytes have been received into buff; returns false if the
+  // transaction should be NACKed
+  static inline bool set_address() {
+    if ((buff.i | 0x7) == 0xffff) {
+      Hooks::signal( (uint8_t)(buff.i & 0x7) );
+      return true;
+    }
+
+    uint16_t a = buff.i & 0x3fff;
+
+    mask = pgm_read_byte (&mem14_group_mask[ buff.c[1] / 0x40 ]);
+    if (mask >= MaxGroup) {
+      Hooks::error(2);
+      return false;  // Group larger than the buffer.
+    }
+
+    if ( (a & mask) != 0) {
+      Hooks::error(1);
+      return false;  // Starting address not properly aligned.
+    }
+
+    // clamp so that out of range addresses fit in index_t; they read as 0 and
+    // ignore writes, exactly as before. So does a group that starts in range
+    // but runs past the end, as fill_group() copies it whole
+    i = a + mask < Size ? (index_t)a : (index_t)Size;
+    return true;
+  }
+
+  // a whole group has been received; i is just past its end
+  static inline void flush_group() {
+    uint8_t *p, *q;
+    p = &store[i];          // passed end of reg block
+    q = &buff.c[(mask+1)];  // passed end of cache
+
+    if (MaxGroup > 4 && mask > 3) {
+      *--p = *--q;
+      *--p = *--q;
+      *--p = *--q;
+      *--p = *--q;
+    }
+    if (MaxGroup > 2 && mask > 1) {
+      *--p = *--q;
+      *--p = *--q;
+    }
+
+    // mask >= 1
+    *--p = *--q;
+    *--p = *--q;
+  }
+
+  // i is at the start of a group
+  static inline void fill_group() {
+    uint8_t *p, *q;
+    q = &store[i];
+    p = &buff.c[0];
+
+    // mask >= 1
+    p[0] = q[0];
+    p[1] = q[1];
+
+    if (MaxGroup > 2 && mask > 1) {
+      p[2] = q[2];
+      p[3] = q[3];
+    }
+    if (MaxGroup > 4 && mask > 3) {
+      p[4] = q[4];
+      p[5] = q[5];
+      p[6] = q[6];
+      p[7] = q[7];
+    }
+  }
+
+public:
+  static uint8_t store[Size];
+
+  static void setup(uint8_t addr) {
+    TWAR = addr << 1;
+  #ifdef TWAMR
+    TWAMR &= (1 << 0); // ensure there is no mask
+  #endif
+    init_ack();
+  }
+
+  // call from ISR(TWI_vect)
+  static inline void isr() {
+    switch (TWSR & 0xF8) {
+      // we just ACKed our address; note that TWDR will contain SLA+W
+      case TW_SR_SLA_ACK:
+        i = -2;
+        mask = 1;
+        init_ack();
+        break;
+
+      case TW_SR_DATA_ACK:
+        if (i < (index_t)WriteLen) {
+          if (0 == mask)
+            store[i++] = TWDR;
+          else {
+            buff.c[i++ & mask] = TWDR;
+
+            if (0 == i) {
+              if (!set_address()) {
+                init_nack();
+                break;
+              }
+            } else if ( 0 == (i & mask) )
+              flush_group();
+          }
+        }
+        init_ack();
+        break;
+
+      case TW_ST_SLA_ACK:
+      case TW_ST_DATA_ACK:
+        if ( i >= 0 && i < (index_t)Size) {
+          if (0 == mask)
+            TWDR = store[i++];
+          else {
+            if (0 == (i & mask))
+              fill_group();
+            TWDR = buff.c[i++ & mask];
+          }
+        } else
+          TWDR = 0;
+
+        init_ack();
+        break;
+
+      case TW_ST_DATA_NACK:
+      case TW_SR_STOP:
+        init_ack();
+        break;
+
+      case TW_BUS_ERROR:
+        init_clear_bus_error();
+        break;
+
+      case TW_SR_ARB_LOST_SLA_ACK:
+      case TW_SR_ARB_LOST_GCALL_ACK:
+      case TW_SR_DATA_NACK:
+      case TW_SR_GCALL_DATA_NACK:
+      case TW_ST_ARB_LOST_SLA_ACK:
+        Hooks::error( TWSR );
+        init_nack();
+        break;
+
+      default:
+        init_nack();
+        break;
+    }
+  }
+};
+
+template <uint16_t Size, uint16_t WriteLen, uint8_t MaxGroup, class Hooks>
+uint8_t Mem14Slave<Size, WriteLen, MaxGroup, Hooks>::store[Size];
+
+template <uint16_t Size, uint16_t WriteLen, uint8_t MaxGroup, class Hooks>
+typename Mem14Slave<Size, WriteLen, MaxGroup, Hooks>::index_t Mem14Slave<Size, WriteLen, MaxGroup, Hooks>::i;
+
+template <uint16_t Size, uint16_t WriteLen, uint8_t MaxGroup, class Hooks>
+typename Mem14Slave<Size, WriteLen, MaxGroup, Hooks>::addr_t Mem14Slave<Size, WriteLen, MaxGroup, Hooks>::buff;
+
+template <uint16_t Size, uint16_t WriteLen, uint8_t MaxGroup, class Hooks>
+uint8_t Mem14Slave<Size, WriteLen, MaxGroup, Hooks>::mask;
+
+#endif // #ifndef TWISlaveMem14_h
@@ -0,0 +1,165 @@
+#ifndef TWITimeout_h
+#define TWITimeout_h
+
+#include <stdint.h>
+#include <avr/io.h>
+
+/* The TWIMaster timeout timer (and the TWI_STAMP_TIMER for USINGLATENCY and
+   USINGBUSLOAD), bound at compile time.
+
+   twiTimerRegs<N> binds the registers of TimerN to static inline accessors, so
+   twiTimeout<N, Cycles> compiles to the same lds/sts as naming TCNT5 and friends
+   directly. Only the timers the chip has are bound (Timer5 doesn't exist on the
+   ATmega328, for one).
+
+   The ISR can't be parameterized this way, as ISR(...) is a macro; TWI_TIMER_vect
+   is pasted together from TWI_TIMER instead.
+
+   Timer0 is used by the Arduino core for millis() and delay(), so it is only safe
+   to use here without the core.
+*/
+
+#define TWI_PASTE3(a, b, c) a ## b ## c
+#define TWI_PASTE3_X(a, b, c) TWI_PASTE3(a, b, c)
+
+// log2 of the divider for each clock select (CS) value; 0xFF where there is none
+#define TWI_CS_SHIFTS      enum { s1 = 0, s2 = 3, s3 = 6, s4 = 8, s5 = 10, s6 = 0xFF, s7 = 0xFF }
+#define TWI_CS_SHIFTS_ASYNC enum { s1 = 0, s2 = 3, s3 = 5, s4 = 6, s5 = 7, s6 = 8, s7 = 10 }
+
+template <uint8_t N> struct twiTimerRegs;
+
+// 16-bit timers: CTC with OCRnA as TOP is WGMn2 in TCCRnB
+#define TWI_TIMER16_REGS(n) \
+template <> struct twiTimerRegs<n> { \
+  typedef uint16_t count_t; \
+  enum { max = 0xFFFF, ocie = OCIE ## n ## A, ocf = OCF ## n ## A, toie = TOIE ## n }; \
+  TWI_CS_SHIFTS; \
+  static inline volatile uint16_t &tcnt()  { return TCNT ## n; } \
+  static inline volatile uint16_t &ocra()  { return OCR ## n ## A; } \
+  static inline volatile uint8_t  &timsk() { return TIMSK ## n; } \
+  static inline volatile uint8_t  &tifr()  { return TIFR ## n; } \
+  static inline void ctc(uint8_t cs) { TCCR ## n ## A = 0; TCCR ## n ## B = (1<<WGM ## n ## 2) | cs; } \
+  static inline void normal(uint8_t cs) { TCCR ## n ## A = 0; TCCR ## n ## B = cs; } \
+};
+
+// 8-bit timers: CTC with OCRnA as TOP is WGMn1 in TCCRnA
+#define TWI_TIMER8_REGS(n, shifts) \
+template <> struct twiTimerRegs<n> { \
+  typedef uint8_t count_t; \
+  enum { max = 0xFF, ocie = OCIE ## n ## A, ocf = OCF ## n ## A, toie = TOIE ## n }; \
+  shifts; \
+  static inline volatile uint8_t &tcnt()  { return TCNT ## n; } \
+  static inline volatile uint8_t &ocra()  { return OCR ## n ## A; } \
+  static inline volatile uint8_t &timsk() { return TIMSK ## n; } \
+  static inline volatile uint8_t &tifr()  { return TIFR ## n; } \
+  static inline void ctc(uint8_t cs) { TCCR ## n ## A = (1<<WGM ## n ## 1); TCCR ## n ## B = cs; } \
+  static inline void normal(uint8_t cs) { TCCR ## n ## A = 0; TCCR ## n ## B = cs; } \
+};
+
+#ifdef TIMSK0
+TWI_TIMER8_REGS(0, TWI_CS_SHIFTS)
+#endif
+#ifdef TIMSK1
+TWI_TIMER16_REGS(1)
+#endif
+#ifdef TIMSK2
+TWI_TIMER8_REGS(2, TWI_CS_SHIFTS_ASYNC) // Timer2 has the /32 and /128 prescalers too
+#endif
+#ifdef TIMSK3
+TWI_TIMER16_REGS(3)
+#endif
+#ifdef TIMSK4
+TWI_TIMER16_REGS(4)
+#endif
+#ifdef TIMSK5
+TWI_TIMER16_REGS(5)
+#endif
+
+// Cycles CPU clocks fit in a timer of max counts with a divider of 2^shift
+#define TWI_FITS(shift) ((shift) <= 10 && (Cycles >> ((shift) & 0xF)) + 1 <= (uint32_t)regs::max)
+
+// times out Cycles CPU clocks after arm() or reset(), using the smallest prescaler
+// that fits, so that the timeout is as precise as the timer allows
+template <uint8_t N, uint32_t Cycles>
+class twiTimeout {
+  typedef twiTimerRegs<N> regs;
+
+public:
+  enum {
+    cs = TWI_FITS(regs::s1) ? 1 :
+         TWI_FITS(regs::s2) ? 2 :
+         TWI_FITS(regs::s3) ? 3 :
+         TWI_FITS(regs::s4) ? 4 :
+         TWI_FITS(regs::s5) ? 5 :
+         TWI_FITS(regs::s6) ? 6 :
+         TWI_FITS(regs::s7) ? 7 : 0,
+    shift = cs == 1 ? regs::s1 : cs == 2 ? regs::s2 : cs == 3 ? regs::s3 :
+            cs == 4 ? regs::s4 : cs == 5 ? regs::s5 : cs == 6 ? regs::s6 : regs::s7
+  };
+
+  // the + 1 is so that rounding down by the prescaler never shortens the timeout
+  static const uint32_t ocr = (Cycles >> (shift & 0xF)) + 1;
+
+private:
+  // the timeout is too long for this timer even with its largest prescaler
+  typedef char check_fits[cs != 0 ? 1 : -1];
+
+public:
+  static inline void init() {
+    regs::timsk() = 0;
+    regs::ctc(cs);
+    regs::ocra() = (typename regs::count_t)ocr;
+    regs::tifr() = 0xFF;
+  }
+
+  // restart the count, e.g. on every TWI interrupt
+  static inline void reset() {
+    regs::tcnt() = 0;
+  }
+
+  static inline void arm() {
+    regs::tcnt() = 0;
+    // there will likely be a pending interrupt, which we must cancel (writing
+    // a 1 clears the flag, and leaves the others alone)
+    regs::tifr() = (1<<regs::ocf);
+    regs::timsk() = (1<<regs::ocie);
+  }
+
+  // re-enable the interrupt without restarting the count
+  static inline void resume() {
+    regs::tifr() = (1<<regs::ocf);
+    regs::timsk() = (1<<regs::ocie);
+  }
+
+  static inline void disable() {
+    regs::timsk() = 0;
+  }
+};
+
+#undef TWI_FITS
+
+// a 16-bit TimerN left counting from 0 to 0xFFFF and around again, for timestamps
+template <uint8_t N, uint8_t CS>
+class twiFreeRunning {
+  typedef twiTimerRegs<N> regs;
+
+  // differences of 16-bit timestamps need all 16 bits to wrap properly
+  typedef char check_16bit[regs::max == 0xFFFF ? 1 : -1];
+
+public:
+  static inline void init() {
+    regs::timsk() = 0;
+    regs::normal(CS);
+  }
+
+  // TIMERn_OVF_vect, every 2^16 ticks
+  static inline void overflow_interrupt() {
+    regs::timsk() = (1<<regs::toie);
+  }
+
+  static inline uint16_t now() {
+    return regs::tcnt();
+  }
+};
+
+#endif // #ifndef TWITimeout_h
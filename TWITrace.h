@@ -0,0 +1,113 @@
+#ifndef TWITrace_h
+#define TWITrace_h
+
+#include <stdint.h>
+#include <avr/io.h>
+
+/* Debug tracing for TWIMaster, chosen at compile time with TWI_TRACE (e.g.
+   -DTWI_TRACE=twiTraceGPIO in Makefile.config):
+
+     twiTraceNull  nothing at all; the default, and generates no instructions
+     twiTraceGPIO  toggles a pin of TWI_TRACE_PORT per event, and holds the
+                   TWI_TRACE_ISR pin high during the TWI ISR (for a logic analyzer)
+     twiTraceRing  logs TWSR and events to twiTraceRing::ring[] in RAM
+     twiTraceSPI   sends TWSR and events out of SPDR (see twi_serial_bridge's
+                   set_up_twi_spi_debugging())
+
+   twiTraceTee<A, B> does both A and B. twiTraceRecord (USINGRECORD in TWIMaster.h)
+   is in TWIRecord.h.
+
+   In the byte logged by twiTraceRing and twiTraceSPI, a TWSR status has its low
+   3 bits clear, and an event has them set: (event << 3) | 7.
+*/
+
+enum {
+  TWI_TRACE_ERROR = 0,     // s_ERROR
+  TWI_TRACE_BUS_ERROR = 1, // s_BUS_ERROR
+  TWI_TRACE_TIMEOUT = 2,   // the timeout timer fired
+  TWI_TRACE_ENQUEUE = 3,   // (twiTraceRecord only) a command was enqueued
+  TWI_TRACE_ISR = 4,       // (GPIO pin only) in the TWI ISR
+  TWI_TRACE_IFREE = 5,     // twiQ.iFree moved
+  TWI_TRACE_ICMD = 6,      // twiQ.iCmd moved
+  TWI_TRACE_ICALLBACK = 7  // twiQ.iCallback moved
+};
+
+#ifndef TWI_TRACE
+#define TWI_TRACE twiTraceNull
+#endif
+
+#define TWI_TRACE_CODE(e) (((e) << 3) | 7)
+
+struct twiTraceNull {
+  static inline void event(uint8_t) {}
+  static inline void isr_enter(uint8_t) {}
+  static inline void isr_exit() {}
+  static inline void enqueue(uint8_t, uint8_t) {}
+};
+
+// this port is nicely organized on the DIP header on the Arduino Mega; the pins
+// of the events that are used must be set as outputs
+#ifndef TWI_TRACE_PORT
+#define TWI_TRACE_PORT PORTA
+#define TWI_TRACE_PIN  PINA
+#endif
+
+struct twiTraceGPIO {
+  // writing a 1 to PINx toggles the pin
+  static inline void event(uint8_t e) { TWI_TRACE_PIN = (1<<e); }
+  static inline void isr_enter(uint8_t) { TWI_TRACE_PORT |= (1<<TWI_TRACE_ISR); }
+  static inline void isr_exit() { TWI_TRACE_PORT &= ~(1<<TWI_TRACE_ISR); }
+  static inline void enqueue(uint8_t, uint8_t) {}
+};
+
+// a power of 2
+#ifndef TWI_TRACE_RING
+#define TWI_TRACE_RING 64
+#endif
+
+// a template so that the ring only takes up RAM if it is used
+template <uint8_t Len>
+struct twiTraceRingT {
+  typedef char check_len[(Len & (Len - 1)) == 0 ? 1 : -1];
+
+  // the most recent byte is at ring[(head - 1) & (Len - 1)]
+  static volatile uint8_t ring[Len];
+  static volatile uint8_t head;
+
+  static inline void log(uint8_t c) {
+    ring[head++ & (Len - 1)] = c;
+  }
+  static inline void event(uint8_t e) { log(TWI_TRACE_CODE(e)); }
+  static inline void isr_enter(uint8_t twsr) { log(twsr); }
+  static inline void isr_exit() {}
+  static inline void enqueue(uint8_t, uint8_t) {}
+};
+
+template <uint8_t Len> volatile uint8_t twiTraceRingT<Len>::ring[Len];
+template <uint8_t Len> volatile uint8_t twiTraceRingT<Len>::head;
+
+typedef twiTraceRingT<TWI_TRACE_RING> twiTraceRing;
+
+struct twiTraceSPI {
+  // a byte written while the last is still going out is dropped (WCOL)
+  static inline void event(uint8_t e) { SPDR = TWI_TRACE_CODE(e); }
+  static inline void isr_enter(uint8_t twsr) {
+    SPDR = twsr;
+  #if !defined(TWI_TIMER) || TWI_TIMER != 2
+    // holds off twi_serial_bridge's Timer2 sampling of TWSR, so it doesn't collide
+    TCNT2 = 0;
+  #endif
+  }
+  static inline void isr_exit() {}
+  static inline void enqueue(uint8_t, uint8_t) {}
+};
+
+template <class A, class B>
+struct twiTraceTee {
+  static inline void event(uint8_t e) { A::event(e); B::event(e); }
+  static inline void isr_enter(uint8_t twsr) { A::isr_enter(twsr); B::isr_enter(twsr); }
+  static inline void isr_exit() { A::isr_exit(); B::isr_exit(); }
+  static inline void enqueue(uint8_t addr_rw, uint8_t len) { A::enqueue(addr_rw, len); B::enqueue(addr_rw, len); }
+};
+
+#endif // #ifndef TWITrace_h
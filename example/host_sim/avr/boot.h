@@ -0,0 +1,50 @@
+#ifndef host_avr_boot_h
+#define host_avr_boot_h
+
+#include <stdint.h>
+#include <string.h>
+#include <avr/io.h>
+
+/* Host stand-in for <avr/boot.h>, over host_flash[] (in host_regs.c). SPM
+   takes no time; host_spm_writes counts the pages written, so a device model
+   can stay off the bus for as long as programming would take.
+
+   ../../TWIBootMem14.c starts the application with BOOT_APP(); here that is
+   host_boot_app(), which the program using it defines.
+*/
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+extern uint8_t host_flash[FLASHEND + 1];
+extern uint8_t host_spm_buffer[SPM_PAGESIZE];
+extern uint32_t host_spm_writes;
+void host_boot_app(void);
+#ifdef __cplusplus
+}
+#endif
+
+#define BOOT_APP() host_boot_app()
+
+static inline void boot_page_erase(uint32_t a) {
+  memset(&host_flash[a & FLASHEND & ~(SPM_PAGESIZE - 1UL)], 0xFF, SPM_PAGESIZE);
+}
+
+static inline void boot_page_fill(uint32_t a, uint16_t w) {
+  host_spm_buffer[a & (SPM_PAGESIZE - 2)] = w & 0xFF;
+  host_spm_buffer[(a & (SPM_PAGESIZE - 2)) + 1] = w >> 8;
+}
+
+// as on the target, this can only clear bits that the erase set
+static inline void boot_page_write(uint32_t a) {
+  uint8_t *p = &host_flash[a & FLASHEND & ~(SPM_PAGESIZE - 1UL)];
+
+  for (uint16_t k = 0; k < SPM_PAGESIZE; k++)
+    p[k] &= host_spm_buffer[k];
+  host_spm_writes++;
+}
+
+static inline void boot_spm_busy_wait(void) {}
+static inline void boot_rww_enable(void) {}
+
+#endif // #ifndef host_avr_boot_h
@@ -0,0 +1,31 @@
+#ifndef host_avr_eeprom_h
+#define host_avr_eeprom_h
+
+#include <stdint.h>
+
+/* Host stand-in for <avr/eeprom.h>, over host_eeprom[] (in host_regs.c).
+*/
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+extern uint8_t host_eeprom[4096];
+#ifdef __cplusplus
+}
+#endif
+
+#define EEMEM
+
+static inline uint8_t eeprom_read_byte(const uint8_t *p) {
+  return host_eeprom[(uintptr_t)p & 0xFFF];
+}
+
+static inline void eeprom_update_byte(uint8_t *p, uint8_t v) {
+  host_eeprom[(uintptr_t)p & 0xFFF] = v;
+}
+
+static inline void eeprom_write_byte(uint8_t *p, uint8_t v) {
+  host_eeprom[(uintptr_t)p & 0xFFF] = v;
+}
+
+#endif // #ifndef host_avr_eeprom_h
@@ -0,0 +1,35 @@
+#ifndef host_avr_interrupt_h
+#define host_avr_interrupt_h
+
+#include <avr/io.h>
+
+/* Host stand-in for <avr/interrupt.h>: ISR(v) defines an ordinary function
+   named by the vector (e.g. host_TWI_vect), which the simulator calls when it
+   wants the interrupt to happen. cli() and sei() only track the I bit in SREG;
+   nothing preempts anything on the host.
+*/
+
+#ifdef __cplusplus
+#define ISR(vector) extern "C" void vector(void); extern "C" void vector(void)
+#else
+#define ISR(vector) void vector(void)
+#endif
+
+#define cli() (SREG &= ~0x80)
+#define sei() (SREG |= 0x80)
+
+/* TWIMaster.h's TWI_POLL_HOOK, run by twiQ.run_callbacks(): the simulator's
+   host_poll, if set, is called when that runs with interrupts enabled, which
+   is how the blocking enqueues wait (see sim_blocking in twi_sim.h).
+*/
+#ifdef __cplusplus
+extern "C" {
+#endif
+extern void (*host_poll)(void);
+#ifdef __cplusplus
+}
+#endif
+
+#define TWI_POLL_HOOK() do { if (host_poll != 0 && (SREG & 0x80)) host_poll(); } while (0)
+
+#endif // #ifndef host_avr_interrupt_h
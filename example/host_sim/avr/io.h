@@ -0,0 +1,233 @@
+#ifndef host_avr_io_h
+#define host_avr_io_h
+
+#include <stdint.h>
+
+/* Host (Linux) stand-in for <avr/io.h>, enough to build ../../TWIMaster.cpp and
+   ../../TWISlaveMem14.c for the host simulator. It describes an ATmega2560.
+
+   Each register is a plain variable (defined in host_regs.c) named host_<REG>,
+   so that the simulator can set TWSR/TWDR before calling an ISR and look at
+   what was written to TWCR afterwards. Interrupt vectors are ordinary
+   functions; see <avr/interrupt.h>.
+
+   Built with -DHOST_TWI_SLAVE (as ../../TWISlaveMem14.c is for twi_bench), the
+   TWI registers are a second set, host_slave_<REG>, so that a slave can share
+   the simulated bus with the master in one process.
+*/
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+extern volatile uint8_t host_slave_TWCR, host_slave_TWSR, host_slave_TWDR, host_slave_TWAR, host_slave_TWAMR;
+extern volatile uint8_t host_TWCR, host_TWSR, host_TWDR, host_TWAR, host_TWAMR, host_TWBR, host_SREG, host_SPDR, host_SPSR, host_SPCR, host_PORTA, host_PINA, host_DDRA, host_PORTB, host_PINB, host_DDRB, host_PORTD, host_PIND, host_DDRD, host_EECR, host_TCCR0A, host_TCCR0B, host_TIMSK0, host_TIFR0, host_TCNT0, host_OCR0A, host_TCCR2A, host_TCCR2B, host_TIMSK2, host_TIFR2, host_TCNT2, host_OCR2A, host_TCCR1A, host_TCCR1B, host_TIMSK1, host_TIFR1, host_TCCR3A, host_TCCR3B, host_TIMSK3, host_TIFR3, host_TCCR4A, host_TCCR4B, host_TIMSK4, host_TIFR4, host_TCCR5A, host_TCCR5B, host_TIMSK5, host_TIFR5;
+extern volatile uint16_t host_TCNT1, host_OCR1A, host_TCNT3, host_OCR3A, host_TCNT4, host_OCR4A, host_TCNT5, host_OCR5A;
+
+#ifdef __cplusplus
+}
+#endif
+
+#ifdef HOST_TWI_SLAVE
+#define TWCR host_slave_TWCR
+#define TWSR host_slave_TWSR
+#define TWDR host_slave_TWDR
+#define TWAR host_slave_TWAR
+#define TWAMR host_slave_TWAMR
+#else
+#define TWCR host_TWCR
+#define TWSR host_TWSR
+#define TWDR host_TWDR
+#define TWAR host_TWAR
+#define TWAMR host_TWAMR
+#endif
+#define TWBR host_TWBR
+#define SREG host_SREG
+#define SPDR host_SPDR
+#define SPSR host_SPSR
+#define SPCR host_SPCR
+#define PORTA host_PORTA
+#define PINA host_PINA
+#define DDRA host_DDRA
+#define PORTB host_PORTB
+#define PINB host_PINB
+#define DDRB host_DDRB
+#define PORTD host_PORTD
+#define PIND host_PIND
+#define DDRD host_DDRD
+#define EECR host_EECR
+#define TCCR0A host_TCCR0A
+#define TCCR0B host_TCCR0B
+#define TIMSK0 host_TIMSK0
+#define TIFR0 host_TIFR0
+#define TCNT0 host_TCNT0
+#define OCR0A host_OCR0A
+#define TCCR2A host_TCCR2A
+#define TCCR2B host_TCCR2B
+#define TIMSK2 host_TIMSK2
+#define TIFR2 host_TIFR2
+#define TCNT2 host_TCNT2
+#define OCR2A host_OCR2A
+#define TCCR1A host_TCCR1A
+#define TCCR1B host_TCCR1B
+#define TIMSK1 host_TIMSK1
+#define TIFR1 host_TIFR1
+#define TCCR3A host_TCCR3A
+#define TCCR3B host_TCCR3B
+#define TIMSK3 host_TIMSK3
+#define TIFR3 host_TIFR3
+#define TCCR4A host_TCCR4A
+#define TCCR4B host_TCCR4B
+#define TIMSK4 host_TIMSK4
+#define TIFR4 host_TIFR4
+#define TCCR5A host_TCCR5A
+#define TCCR5B host_TCCR5B
+#define TIMSK5 host_TIMSK5
+#define TIFR5 host_TIFR5
+#define TCNT1 host_TCNT1
+#define OCR1A host_OCR1A
+#define TCNT3 host_TCNT3
+#define OCR3A host_OCR3A
+#define TCNT4 host_TCNT4
+#define OCR4A host_OCR4A
+#define TCNT5 host_TCNT5
+#define OCR5A host_OCR5A
+
+/* bits
+*/
+#define TWINT 7
+#define TWEA  6
+#define TWSTA 5
+#define TWSTO 4
+#define TWWC  3
+#define TWEN  2
+#define TWIE  0
+#define TWPS1 1
+#define TWPS0 0
+#define TWGCE 0
+
+#define SPIF  7
+#define WCOL  6
+#define SPI2X 0
+#define SPE   6
+#define MSTR  4
+#define SPR0  0
+
+#define PA0 0
+#define PA1 1
+#define PA2 2
+#define PA3 3
+#define PA4 4
+#define PA5 5
+#define PA6 6
+#define PA7 7
+#define PB0 0
+#define PB1 1
+#define PB2 2
+#define PB3 3
+#define PB4 4
+#define PB5 5
+#define PB6 6
+#define PB7 7
+#define PD0 0
+#define PD1 1
+#define PD2 2
+#define PD3 3
+#define PD4 4
+#define PD5 5
+#define PD6 6
+#define PD7 7
+
+#define TOIE0 0
+#define OCIE0A 1
+#define TOV0 0
+#define OCF0A 1
+#define CS00 0
+#define CS01 1
+#define CS02 2
+#define WGM00 0
+#define WGM01 1
+#define WGM02 3
+#define COM0A0 6
+#define TOIE2 0
+#define OCIE2A 1
+#define TOV2 0
+#define OCF2A 1
+#define CS20 0
+#define CS21 1
+#define CS22 2
+#define WGM20 0
+#define WGM21 1
+#define WGM22 3
+#define COM2A0 6
+#define TOIE1 0
+#define OCIE1A 1
+#define TOV1 0
+#define OCF1A 1
+#define CS10 0
+#define CS11 1
+#define CS12 2
+#define WGM10 0
+#define WGM11 1
+#define WGM12 3
+#define WGM13 4
+#define COM1A0 6
+#define TOIE3 0
+#define OCIE3A 1
+#define TOV3 0
+#define OCF3A 1
+#define CS30 0
+#define CS31 1
+#define CS32 2
+#define WGM30 0
+#define WGM31 1
+#define WGM32 3
+#define WGM33 4
+#define COM3A0 6
+#define TOIE4 0
+#define OCIE4A 1
+#define TOV4 0
+#define OCF4A 1
+#define CS40 0
+#define CS41 1
+#define CS42 2
+#define WGM40 0
+#define WGM41 1
+#define WGM42 3
+#define WGM43 4
+#define COM4A0 6
+#define TOIE5 0
+#define OCIE5A 1
+#define TOV5 0
+#define OCF5A 1
+#define CS50 0
+#define CS51 1
+#define CS52 2
+#define WGM50 0
+#define WGM51 1
+#define WGM52 3
+#define WGM53 4
+#define COM5A0 6
+
+/* memories
+*/
+#define FLASHEND     0x3FFFF
+#define SPM_PAGESIZE 256
+
+/* vectors; see <avr/interrupt.h>
+*/
+#define TWI_vect host_TWI_vect
+#define TIMER0_COMPA_vect host_TIMER0_COMPA_vect
+#define TIMER0_OVF_vect host_TIMER0_OVF_vect
+#define TIMER2_COMPA_vect host_TIMER2_COMPA_vect
+#define TIMER2_OVF_vect host_TIMER2_OVF_vect
+#define TIMER1_COMPA_vect host_TIMER1_COMPA_vect
+#define TIMER1_OVF_vect host_TIMER1_OVF_vect
+#define TIMER3_COMPA_vect host_TIMER3_COMPA_vect
+#define TIMER3_OVF_vect host_TIMER3_OVF_vect
+#define TIMER4_COMPA_vect host_TIMER4_COMPA_vect
+#define TIMER4_OVF_vect host_TIMER4_OVF_vect
+#define TIMER5_COMPA_vect host_TIMER5_COMPA_vect
+#define TIMER5_OVF_vect host_TIMER5_OVF_vect
+
+#endif // #ifndef host_avr_io_h
@@ -0,0 +1,16 @@
+#ifndef host_avr_pgmspace_h
+#define host_avr_pgmspace_h
+
+#include <stdint.h>
+
+/* Host stand-in for <avr/pgmspace.h>: flash is ordinary memory.
+
+   pgm_read_word(p) returns *p at its own type, as TWIMaster.cpp uses it to read
+   function pointers, which are wider than 16 bits on the host.
+*/
+
+#define PROGMEM
+#define pgm_read_byte(p) (*(const uint8_t *)(p))
+#define pgm_read_word(p) (*(p))
+
+#endif // #ifndef host_avr_pgmspace_h
@@ -0,0 +1,154 @@
+/* boot_test: ../../TWIBootUpload.h against ../../TWIBootMem14.c, on the
+   simulated bus of twi_sim.h.
+
+     ./boot_test
+
+   twiSimBoot runs the real bootloader state machine (boot_twi(), built with
+   -DBOOT_NO_MAIN -DHOST_TWI_SLAVE) over its own set of TWI registers and the
+   host's flash, and stays off the bus while a page is programmed, so the
+   uploader has to ACK-poll. The cases upload a small image and check what is
+   in flash, then a page in the boot section, which must be refused, and the
+   exit to the application. The exit status is 1 if any case failed.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <util/twi.h>
+#include <avr/boot.h>
+#include "TWIBootUpload.h"
+#include "twi_sim.h"
+
+extern "C" {
+void boot_init(void);
+uint8_t boot_twi(void);
+}
+
+static const char *name;
+static uint16_t failures;
+
+#define CHECK(cond) \
+  do { if (!(cond)) { failures++; printf("%s:%d: %s: %s\n", __FILE__, __LINE__, name, #cond); } } while (0)
+
+static bool app_started;
+
+void host_boot_app(void) {
+  app_started = true;
+}
+
+// the bootloader at addr (its BOOT_TWI_ADDRESS), as a device on the bus
+class twiSimBoot : public twiSimDevice {
+public:
+  uint64_t program_cycles; // a page erase and write, 3.7 - 4.5ms in the datasheet
+  uint32_t busy_nacks;     // addresses NACKed while programming
+
+  twiSimBoot(uint8_t addr = 0x50) :
+    twiSimDevice(addr), program_cycles((uint64_t)F_CPU * 45 / 10000), busy_nacks(0),
+    receiving(false), now(0), busy_until(0)
+  {
+    boot_init();
+  }
+
+  bool start(bool read) {
+    if (app_started)
+      return false;
+    if (now < busy_until) {
+      busy_nacks++;
+      return false;
+    }
+    // the hardware only ACKs its address with TWEA set
+    if (!(host_slave_TWCR & (1<<TWEA)))
+      return false;
+
+    receiving = !read;
+    twi(read ? TW_ST_SLA_ACK : TW_SR_SLA_ACK, (addr << 1) | read);
+    return true;
+  }
+
+  bool write(uint8_t b) {
+    bool ack = (host_slave_TWCR & (1<<TWEA)) != 0;
+    twi(ack ? TW_SR_DATA_ACK : TW_SR_DATA_NACK, b);
+    return ack;
+  }
+
+  uint8_t read(bool ack) {
+    uint8_t b = host_slave_TWDR;
+    twi(!ack ? TW_ST_DATA_NACK :
+        (host_slave_TWCR & (1<<TWEA)) ? TW_ST_DATA_ACK : TW_ST_LAST_DATA, b);
+    return b;
+  }
+
+  // a command runs at the STOP; the flash is written at once, but the
+  // bootloader would be busy for program_cycles
+  void stop() {
+    uint32_t writes = host_spm_writes;
+
+    if (receiving)
+      twi(TW_SR_STOP, 0);
+    receiving = false;
+    if (host_spm_writes != writes)
+      busy_until = now + program_cycles;
+  }
+
+  void tick(uint64_t now_) {
+    now = now_;
+  }
+
+private:
+  bool receiving;
+  uint64_t now;
+  uint64_t busy_until;
+
+  void twi(uint8_t status, uint8_t data) {
+    host_slave_TWSR = status;
+    host_slave_TWDR = data;
+    boot_twi();
+  }
+};
+
+static twiSimBoot boot;
+
+int main() {
+  char image[3 * SPM_PAGESIZE];
+  uint16_t pagesize;
+
+  i2c_master_initialize();
+  sei();
+  sim_attach(&boot);
+  sim_blocking(1000);
+
+  name = "page size";
+  pagesize = twi_boot_pagesize(0x50);
+  CHECK(pagesize == SPM_PAGESIZE);
+
+  // pages 1 - 3 of the application section
+  name = "upload";
+  for (uint16_t k = 0; k < sizeof(image); k++)
+    image[k] = (char)(k * 7 + (k >> 8));
+  memset(host_flash, 0xFF, sizeof(host_flash));
+  for (uint16_t p = 0; p < 3; p++)
+    CHECK(twi_boot_write_page(0x50, 1 + p, &image[p * SPM_PAGESIZE], pagesize) == BOOT_OK);
+  CHECK(memcmp(&host_flash[SPM_PAGESIZE], image, sizeof(image)) == 0);
+  CHECK(host_spm_writes == 3);
+  CHECK(boot.busy_nacks > 0);
+
+  // the first page of the boot section is refused, and the status of the
+  // last page written isn't taken for its own
+  name = "boot section";
+  uint16_t first = (FLASHEND + 1UL - 0x2000UL) / SPM_PAGESIZE;
+  CHECK(twi_boot_write_page(0x50, first, image, pagesize) == BOOT_BAD_PAGE);
+  CHECK(host_spm_writes == 3);
+  CHECK(host_flash[(uint32_t)first * SPM_PAGESIZE] == 0xFF);
+
+  // ... and the next good page goes in as usual
+  name = "upload after a refusal";
+  CHECK(twi_boot_write_page(0x50, 0, image, pagesize) == BOOT_OK);
+  CHECK(memcmp(host_flash, image, SPM_PAGESIZE) == 0);
+
+  name = "exit";
+  CHECK(twi_boot_exit(0x50));
+  CHECK(app_started);
+  CHECK(twi_boot_pagesize(0x50) == 0);
+
+  printf("%u failures\n", failures);
+  return failures ? 1 : 0;
+}
@@ -0,0 +1,19 @@
+/* The registers declared in avr/io.h, as plain variables, and what the other
+   stand-in headers declare.
+*/
+
+#include <avr/io.h>
+#include <avr/boot.h>
+#include <avr/interrupt.h>
+
+volatile uint8_t host_slave_TWCR, host_slave_TWSR, host_slave_TWDR, host_slave_TWAR, host_slave_TWAMR;
+volatile uint8_t host_TWCR, host_TWSR, host_TWDR, host_TWAR, host_TWAMR, host_TWBR, host_SREG, host_SPDR, host_SPSR, host_SPCR, host_PORTA, host_PINA, host_DDRA, host_PORTB, host_PINB, host_DDRB, host_PORTD, host_PIND, host_DDRD, host_EECR, host_TCCR0A, host_TCCR0B, host_TIMSK0, host_TIFR0, host_TCNT0, host_OCR0A, host_TCCR2A, host_TCCR2B, host_TIMSK2, host_TIFR2, host_TCNT2, host_OCR2A, host_TCCR1A, host_TCCR1B, host_TIMSK1, host_TIFR1, host_TCCR3A, host_TCCR3B, host_TIMSK3, host_TIFR3, host_TCCR4A, host_TCCR4B, host_TIMSK4, host_TIFR4, host_TCCR5A, host_TCCR5B, host_TIMSK5, host_TIFR5;
+volatile uint16_t host_TCNT1, host_OCR1A, host_TCNT3, host_OCR3A, host_TCNT4, host_OCR4A, host_TCNT5, host_OCR5A;
+
+uint8_t host_eeprom[4096];
+
+uint8_t host_flash[FLASHEND + 1];
+uint8_t host_spm_buffer[SPM_PAGESIZE];
+uint32_t host_spm_writes;
+
+void (*host_poll)(void);
@@ -0,0 +1,520 @@
+/* master_test: host tests for the master's optional paths (../../TWIMaster.cpp),
+   on the simulated bus of twi_sim.h.
+
+     ./master_test
+     ./master_test_sp    (the same cases, with USINGSINGLEPRODUCER)
+
+   Each case enqueues commands for the device models, runs the bus until they
+   are called back, and checks their states, the data moved and the statuses
+   the master was given. The cases for an option are only built where it is
+   defined; the Makefile builds this with the options it covers, whatever
+   OPTIONS says. The exit status is 1 if any case failed.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <util/twi.h>
+#include "TWIMaster.h"
+#include "TWIHelper.h"
+#include "TWICrc8.h"
+#include "twi_sim.h"
+#include "twi_models.h"
+
+static const char *name;
+static uint16_t failures;
+
+#define CHECK(cond) \
+  do { if (!(cond)) { failures++; printf("%s:%d: %s: %s\n", __FILE__, __LINE__, name, #cond); } } while (0)
+
+// the statuses put in TWSR, in order
+static uint8_t trace[1024];
+static uint16_t ntrace;
+
+static uint8_t watch(uint8_t status) {
+  if (ntrace < sizeof(trace))
+    trace[ntrace++] = status;
+  return status;
+}
+
+static uint16_t traced(uint8_t status) {
+  uint16_t n = 0;
+  for (uint16_t k = 0; k < ntrace; k++)
+    n += trace[k] == status;
+  return n;
+}
+
+// the final states of the commands called back since begin(...)
+static uint8_t states[TWI_QUEUE_SIZE];
+static uint8_t ncalled;
+
+static void done(state_t *s) {
+  if (ncalled < sizeof(states))
+    states[ncalled] = s->state;
+  ncalled++;
+}
+
+static bool ok(uint8_t k) {
+  return k < ncalled && (states[k] & (1<<STATE_SUCCESS_BIT));
+}
+
+static void begin(const char *n) {
+  name = n;
+  ncalled = 0;
+  ntrace = 0;
+}
+
+// runs the bus until n commands have been called back since begin(...), or
+// for a simulated second; returns false in the second case
+static bool run(uint8_t n) {
+  uint64_t until = sim_now() + F_CPU;
+
+  while (ncalled < n && sim_now() < until)
+    sim_run(sim_now() + 1000);
+  return ncalled == n;
+}
+
+
+/* A memory written and read from its start by every transfer, at a 7-bit
+   address or a 10-bit one. For a 10-bit address, addr is 11110xx (A9 and A8)
+   and the first byte written is A7..A0; a read is only ACKed by the device
+   that took the last write's A7..A0.
+*/
+
+class testDevice : public twiSimDevice {
+public:
+  uint8_t mem[512];
+  uint16_t written;  // bytes written by the last write
+  uint16_t reads;    // times addressed with SLA+R
+  uint16_t writes;   // ... and SLA+W
+
+  testDevice(uint8_t addr) :
+    twiSimDevice(addr), written(0), reads(0), writes(0), lo(-1), lo_next(false), selected(false), pos(0)
+  {
+    memset(mem, 0, sizeof(mem));
+  }
+
+  // a device with 10-bit address a
+  testDevice(uint16_t a, bool) :
+    twiSimDevice(0x78 | (a >> 8)), written(0), reads(0), writes(0), lo(a & 0xFF), lo_next(false), selected(false), pos(0)
+  {
+    memset(mem, 0, sizeof(mem));
+  }
+
+  bool start(bool read) {
+    if (lo >= 0) {
+      if (read && !selected)
+        return false;
+      lo_next = !read;
+    }
+
+    pos = 0;
+    if (read)
+      reads++;
+    else {
+      writes++;
+      written = 0;
+    }
+    return true;
+  }
+
+  bool write(uint8_t b) {
+    if (lo_next) {
+      lo_next = false;
+      selected = b == lo;
+      return selected;
+    }
+
+    if (pos < sizeof(mem))
+      mem[pos++] = b;
+    written++;
+    return true;
+  }
+
+  uint8_t read(bool ack) {
+    return pos < sizeof(mem) ? mem[pos++] : 0xFF;
+  }
+
+private:
+  int16_t lo;    // A7..A0 of a 10-bit address, or -1
+  bool lo_next;  // the next byte written is A7..A0
+  bool selected; // ... and the last one matched
+  uint16_t pos;
+};
+
+static testDevice dev7(0x20);
+static testDevice dev10(0x2A5, true);
+
+
+/* The queue itself: TWI_QUEUE_SIZE - 1 commands fit, and are called back in
+   the order they were enqueued. master_test_sp runs this with
+   USINGSINGLEPRODUCER, where the entries are filled with interrupts enabled.
+*/
+
+static twi_len_t order[TWI_QUEUE_SIZE];
+
+static void done_order(state_t *s) {
+  if (ncalled < sizeof(order) / sizeof(order[0]))
+    order[ncalled] = s->len;
+  done(s);
+}
+
+static void test_queue() {
+  static char w[TWI_QUEUE_SIZE];
+
+  // the bus doesn't move until run(...), so nothing is freed meanwhile
+  begin("full queue");
+  for (uint8_t k = 1; k < TWI_QUEUE_SIZE; k++)
+    CHECK(twiQ.enqueue_w(0x20, w, k, done_order));
+  CHECK(!twiQ.enqueue_w(0x20, w, 1, done_order));
+  CHECK(run(TWI_QUEUE_SIZE - 1));
+  for (uint8_t k = 0; k < TWI_QUEUE_SIZE - 1; k++)
+    CHECK(ok(k) && order[k] == k + 1);
+
+  // ... and the entries are free again
+  begin("queue after a full one");
+  CHECK(twiQ.enqueue_w(0x20, w, 2, done_order));
+  CHECK(run(1) && ok(0));
+  CHECK(dev7.written == 2);
+}
+
+
+/* 10-bit addresses: 11110xx0 and A7..A0, then for a read a repeated START and
+   11110xx1
+*/
+
+static void test_tenbit() {
+  char w[3] = { 'a', 'b', 'c' }, r[3];
+
+  begin("10-bit write");
+  CHECK(twiQ.enqueue_w10(0x2A5, w, sizeof(w), done));
+  CHECK(run(1) && ok(0));
+  CHECK(dev10.written == 3 && memcmp(dev10.mem, w, 3) == 0);
+  CHECK(ntrace == 6 && trace[0] == TW_START && trace[1] == TW_MT_SLA_ACK && traced(TW_MT_DATA_ACK) == 4);
+
+  begin("10-bit read");
+  memset(r, 0, sizeof(r));
+  CHECK(twiQ.enqueue_r10(0x2A5, r, sizeof(r), done));
+  CHECK(run(1) && ok(0));
+  CHECK(memcmp(r, w, 3) == 0);
+  static const uint8_t read_trace[] = { TW_START, TW_MT_SLA_ACK, TW_MT_DATA_ACK, TW_REP_START,
+                                        TW_MR_SLA_ACK, TW_MR_DATA_ACK, TW_MR_DATA_ACK, TW_MR_DATA_NACK };
+  CHECK(ntrace == sizeof(read_trace) && memcmp(trace, read_trace, ntrace) == 0);
+
+  // the blocking versions, and a 7-bit read straight after
+  begin("10-bit blocking");
+  memset(dev7.mem, 'z', 3);
+  CHECK(twiQ.enqueue_wb10(0x2A5, w, 2, NULL));
+  CHECK(twiQ.enqueue_rb10(0x2A5, r, 2, NULL));
+  CHECK(twiQ.enqueue_rb(0x20, r, 1, NULL));
+  CHECK(r[0] == 'z' && r[1] == 'b');
+
+  // A7..A0 of another device is NACKed, in a write and in a read alike
+  begin("10-bit, other device");
+  CHECK(twiQ.enqueue_w10(0x2A6, w, sizeof(w), done));
+  CHECK(twiQ.enqueue_r10(0x2A6, r, sizeof(r), done));
+  CHECK(run(2));
+  CHECK(states[0] == TW_MT_DATA_NACK && states[1] == TW_MT_DATA_NACK);
+  CHECK(dev10.written == 0);
+}
+
+
+/* 16-bit lengths (USINGBULK): transfers longer than 255 bytes
+*/
+
+#ifdef USINGBULK
+static void test_bulk() {
+  static char w[300], r[300];
+
+  for (uint16_t k = 0; k < sizeof(w); k++)
+    w[k] = (char)(k * 13 + (k >> 8));
+
+  begin("300-byte write");
+  CHECK(twiQ.enqueue_w(0x20, w, sizeof(w), done));
+  CHECK(run(1) && ok(0));
+  CHECK(dev7.written == 300 && memcmp(dev7.mem, w, sizeof(w)) == 0);
+  CHECK(traced(TW_MT_DATA_ACK) == 300);
+
+  begin("300-byte read");
+  memset(r, 0, sizeof(r));
+  CHECK(twiQ.enqueue_r(0x20, r, sizeof(r), done));
+  CHECK(run(1) && ok(0));
+  CHECK(memcmp(r, w, sizeof(r)) == 0);
+  CHECK(traced(TW_MR_DATA_ACK) == 299 && traced(TW_MR_DATA_NACK) == 1);
+}
+#endif
+
+
+/* Inline payloads (USINGINLINE): the data in the queue entry itself
+*/
+
+#ifdef USINGINLINE
+static char inline_in[TWI_INLINE_LEN];
+
+static void copy_inline(state_t *s) {
+  memcpy(inline_in, state_data(s), s->len);
+  done(s);
+}
+
+static void test_inline() {
+  char b[TWI_INLINE_LEN + 1];
+
+  // the buffer can be reused as soon as the write is enqueued
+  begin("inline write");
+  memcpy(b, "wxyz", TWI_INLINE_LEN);
+  CHECK(twiQ.enqueue_w_inline(0x20, b, TWI_INLINE_LEN, done));
+  memset(b, 0, sizeof(b));
+  CHECK(run(1) && ok(0));
+  CHECK(dev7.written == TWI_INLINE_LEN && memcmp(dev7.mem, "wxyz", TWI_INLINE_LEN) == 0);
+
+  begin("inline read");
+  memset(inline_in, 0, sizeof(inline_in));
+  CHECK(twiQ.enqueue_r_inline(0x20, TWI_INLINE_LEN, copy_inline));
+  CHECK(run(1) && ok(0));
+  CHECK(memcmp(inline_in, "wxyz", TWI_INLINE_LEN) == 0);
+
+  begin("inline, too long");
+  CHECK(!twiQ.enqueue_w_inline(0x20, b, TWI_INLINE_LEN + 1, done));
+  CHECK(!twiQ.enqueue_r_inline(0x20, TWI_INLINE_LEN + 1, done));
+
+  // twi_write8_async's bytes are on its stack
+  begin("twi_write8_async");
+  CHECK(twi_write8_async(0x20, 'm', 'v'));
+  sim_run(sim_now() + F_CPU / 100);
+  CHECK(dev7.written == 2 && dev7.mem[0] == 'm' && dev7.mem[1] == 'v');
+}
+#endif
+
+
+/* SMBus quick commands: the address alone, with its R/W bit as the data
+*/
+
+static void test_quick() {
+  char w[1] = { 'q' };
+
+  begin("quick write and read");
+  uint16_t writes = dev7.writes, reads = dev7.reads;
+  CHECK(twi_quick(0x20, 0));
+  CHECK(twi_quick(0x20, 1));
+  CHECK(dev7.writes == writes + 1 && dev7.reads == reads + 1);
+  CHECK(dev7.written == 0);
+  // the read has to take a byte, NACKed, before the STOP, as the device may
+  // already hold SDA low for its first bit
+  static const uint8_t quick_trace[] = { TW_START, TW_MT_SLA_ACK, TW_START, TW_MR_SLA_ACK, TW_MR_DATA_NACK };
+  CHECK(ntrace == sizeof(quick_trace) && memcmp(trace, quick_trace, ntrace) == 0);
+
+  begin("quick, no device");
+  CHECK(!twi_quick(0x21, 0));
+  CHECK(!twi_quick(0x21, 1));
+  CHECK(ntrace == 4 && trace[1] == TW_MT_SLA_NACK && trace[3] == TW_MR_SLA_NACK);
+
+  // a NOP in the entry a quick command was last in is still a NOP: once round
+  // the queue after a quick command, a NOP and a write send one START
+  begin("NOP after a quick command");
+  CHECK(twi_quick(0x20, 0));
+  for (uint8_t k = 0; k < TWI_QUEUE_SIZE - 1; k++) {
+    CHECK(twiQ.enqueue_w(0x20, w, sizeof(w), done));
+    CHECK(run(k + 1));
+  }
+  begin("NOP after a quick command");
+  writes = dev7.writes;
+  cli();
+  CHECK(twiQ.enqueue_nop(done));
+  CHECK(twiQ.enqueue_w(0x20, w, sizeof(w), done));
+  sei();
+  CHECK(run(2) && ok(0) && ok(1));
+  CHECK(traced(TW_START) + traced(TW_REP_START) == 1);
+  CHECK(dev7.writes == writes + 1);
+}
+
+
+/* An SMBus device with blocks to read: the command written selects block[cmd],
+   which is read as its count and bytes, then the SMBus PEC of the whole
+   transfer (SLA+W, the command, SLA+R, the count and the bytes).
+*/
+
+class blockDevice : public twiSimDevice {
+public:
+  uint8_t block[4][8];
+  uint8_t count[4];
+
+  blockDevice(uint8_t addr) : twiSimDevice(addr), cmd(0), pos(0), pec(0) {}
+
+  bool start(bool read) {
+    pec = crc8(read ? pec : 0, (addr << 1) | read);
+    pos = read ? 0 : -1;
+    return true;
+  }
+
+  bool write(uint8_t b) {
+    pec = crc8(pec, b);
+    if (pos < 0)
+      cmd = b & 3;
+    return true;
+  }
+
+  uint8_t read(bool ack) {
+    uint8_t n = count[cmd], b;
+
+    if (pos == 0)
+      b = n;
+    else if (pos <= n)
+      b = block[cmd][pos - 1];
+    else if (pos == n + 1)
+      b = pec;
+    else
+      b = 0xFF;
+    pos++;
+    pec = crc8(pec, b);
+    return b;
+  }
+
+private:
+  uint8_t cmd;
+  int16_t pos;  // of the next byte read, or -1 in a write
+  uint8_t pec;
+};
+
+static blockDevice blk(0x0B);
+
+// the command, then a block read of it a repeated START after
+static bool block_read(uint8_t cmd, char *p, twi_len_t len, uint8_t flags) {
+  char c[1] = { (char)cmd };
+
+  cli();
+  CHECK(twiQ.enqueue_w(0x0B, c, sizeof(c), done));
+  CHECK(twiQ.enqueue_r(0x0B, p, len, done, flags | (1<<FLAG_BLOCK_BIT)));
+  sei();
+  return run(2) && ok(0) && ok(1);
+}
+
+static void test_block() {
+  char p[12];
+
+  memcpy(blk.block[1], "abcde", 5);
+  blk.count[1] = 5;
+  blk.count[2] = 0;
+
+  begin("block read");
+  memset(p, 0, sizeof(p));
+  CHECK(twi_block_read(0x0B, 1, p, 8) == 5);
+  CHECK(p[0] == 5 && memcmp(&p[1], "abcde", 5) == 0);
+  CHECK(traced(TW_START) == 1 && traced(TW_REP_START) == 1);
+  CHECK(traced(TW_MR_DATA_ACK) == 5 && traced(TW_MR_DATA_NACK) == 1);
+
+  // a count larger than the buffer takes what fits, and no more
+  begin("block read, count clamped");
+  memset(p, '#', sizeof(p));
+  CHECK(twi_block_read(0x0B, 1, p, 3) == 2);
+  CHECK(memcmp(&p[1], "ab", 2) == 0 && p[3] == '#');
+
+  begin("block read, count 0");
+  memset(p, '#', sizeof(p));
+  CHECK(twi_block_read(0x0B, 2, p, 8) == 0);
+  CHECK(p[0] == 0 && p[1] == '#');
+
+#ifdef USINGPEC
+  begin("block read with PEC");
+  memset(p, 0, sizeof(p));
+  CHECK(block_read(1, p, 8, (1<<FLAG_PEC_BIT)));
+  CHECK(!(states[1] & (1<<STATE_PEC_BIT)));
+  CHECK(p[0] == 5 && memcmp(&p[1], "abcde", 5) == 0);
+
+  begin("block read with PEC, count 0");
+  memset(p, '#', sizeof(p));
+  CHECK(block_read(2, p, 1, (1<<FLAG_PEC_BIT)));
+  CHECK(p[0] == 0 && p[1] == '#');
+
+  // only the count fits: the byte after it is taken as the PEC, which then
+  // fails, and nothing is written past the buffer
+  begin("block read with PEC, no room");
+  memset(p, '#', sizeof(p));
+  CHECK(!block_read(1, p, 1, (1<<FLAG_PEC_BIT)));
+  CHECK(ok(0) && (states[1] & (1<<STATE_PEC_BIT)));
+  CHECK(p[0] == 5 && p[1] == '#' && p[2] == '#');
+#endif
+}
+
+
+/* SMBus PEC, against the real TWISlaveMem14.c (built with USINGPEC)
+*/
+
+#ifdef USINGPEC
+static twiSimMem14 mem(0x50);
+
+// the Mem14 address bytes of a, for groups of 4
+static void mem14_address(char *b, uint16_t a) {
+  b[0] = a & 0xFF;
+  b[1] = 0x80 | ((a >> 8) & 0x3F);
+}
+
+static void test_pec() {
+  char w[6], a[2], r[4];
+
+  // a grouped write carries its PEC, and is stored as the PEC matches
+  begin("PEC write");
+  mem14_address(w, 0x10);
+  memcpy(&w[2], "\x11\x22\x33\x44", 4);
+  CHECK(twiQ.enqueue_w(0x50, w, sizeof(w), done, (1<<FLAG_PEC_BIT)));
+  CHECK(run(1) && ok(0));
+  CHECK(memcmp(&mem.store[0x10], &w[2], 4) == 0);
+  CHECK(mem.user_errors == 0);
+
+  // the address written and then read, a STOP apart, as twi_mem14_read does:
+  // the read's PEC covers the address write too, on both sides
+  begin("PEC read after a STOP");
+  mem14_address(a, 0x10);
+  memset(r, 0, sizeof(r));
+  CHECK(twiQ.enqueue_w(0x50, a, sizeof(a), done));
+  CHECK(run(1) && ok(0));
+  CHECK(twiQ.enqueue_r(0x50, r, sizeof(r), done, (1<<FLAG_PEC_BIT)));
+  CHECK(run(2) && ok(1));
+  CHECK(!(states[1] & (1<<STATE_PEC_BIT)));
+  CHECK(memcmp(r, &w[2], 4) == 0);
+  CHECK(traced(TW_START) == 2 && traced(TW_REP_START) == 0);
+
+  // ... and back to back, a repeated START apart
+  begin("PEC read after a repeated START");
+  memset(r, 0, sizeof(r));
+  cli();
+  CHECK(twiQ.enqueue_w(0x50, a, sizeof(a), done));
+  CHECK(twiQ.enqueue_r(0x50, r, sizeof(r), done, (1<<FLAG_PEC_BIT)));
+  sei();
+  CHECK(run(2) && ok(0) && ok(1));
+  CHECK(!(states[1] & (1<<STATE_PEC_BIT)));
+  CHECK(memcmp(r, &w[2], 4) == 0);
+  CHECK(traced(TW_START) == 1 && traced(TW_REP_START) == 1);
+
+  CHECK(mem.user_errors == 0);
+}
+#endif
+
+
+int main() {
+  sim_fault = watch;
+  i2c_master_initialize();
+  sei();
+  sim_blocking(1000);
+
+  sim_attach(&dev7);
+  sim_attach(&dev10);
+  test_queue();
+  test_tenbit();
+  test_quick();
+#ifdef USINGBULK
+  test_bulk();
+#endif
+#ifdef USINGINLINE
+  test_inline();
+#endif
+
+  sim_attach(&blk);
+  test_block();
+
+#ifdef USINGPEC
+  sim_attach(&mem);
+  test_pec();
+#endif
+
+  printf("%u failures\n", failures);
+  return failures ? 1 : 0;
+}
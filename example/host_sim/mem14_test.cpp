@@ -0,0 +1,185 @@
+/* mem14_test: host unit tests for the Mem14Slave template (../../TWISlaveMem14.h).
+
+     ./mem14_test
+
+   Each case feeds one slave instantiation the statuses and bytes the TWI
+   hardware would give it for a transfer, as in twiSimMem14, and checks its
+   store, what it sends back, its ACKs and its Hooks::error() calls. The exit
+   status is 1 if any case failed.
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <util/twi.h>
+#include "TWISlaveMem14.h"
+
+static uint16_t errors[4]; // Hooks::error(1), (2) and (3); [0] is anything else
+static uint8_t signals;
+
+struct TestHooks {
+  static void error(uint8_t e) { errors[e < 4 ? e : 0]++; }
+  static void signal(uint8_t s) { signals++; }
+};
+
+static uint16_t failures;
+
+#define CHECK(cond) \
+  do { if (!(cond)) { failures++; printf("%s:%d: %s: %s\n", __FILE__, __LINE__, name, #cond); } } while (0)
+
+// the Mem14 address bytes: A7..A0, then the group size (0 for none, 2, 4 or 8)
+// in the top two bits over A13..A8
+static void address(uint16_t a, uint8_t group, uint8_t *b) {
+  uint8_t g = group == 8 ? 3 : group == 4 ? 2 : group == 2 ? 1 : 0;
+  b[0] = a & 0xFF;
+  b[1] = (g << 6) | ((a >> 8) & 0x3F);
+}
+
+template <class S>
+static void status(uint8_t st, uint8_t data = 0) {
+  TWSR = st;
+  TWDR = data;
+  S::isr();
+}
+
+// SLA+W, then the address and the data; returns false if the slave NACKed a byte
+template <class S>
+static bool write(uint16_t a, uint8_t group, const uint8_t *data, uint8_t len) {
+  uint8_t b[2];
+  address(a, group, b);
+
+  status<S>(TW_SR_SLA_ACK, 0xA0);
+  for (uint8_t k = 0; k < 2 + len; k++) {
+    status<S>(TW_SR_DATA_ACK, k < 2 ? b[k] : data[k - 2]);
+    if (!(TWCR & (1<<TWEA)))
+      return false;
+  }
+  status<S>(TW_SR_STOP);
+  return true;
+}
+
+// the address as a write, then a repeated START and SLA+R for len bytes
+template <class S>
+static bool read(uint16_t a, uint8_t group, uint8_t *data, uint8_t len) {
+  uint8_t b[2];
+  address(a, group, b);
+
+  status<S>(TW_SR_SLA_ACK, 0xA0);
+  for (uint8_t k = 0; k < 2; k++) {
+    status<S>(TW_SR_DATA_ACK, b[k]);
+    if (!(TWCR & (1<<TWEA)))
+      return false;
+  }
+  status<S>(TW_SR_STOP);
+
+  for (uint8_t k = 0; k < len; k++) {
+    status<S>(k == 0 ? TW_ST_SLA_ACK : TW_ST_DATA_ACK, 0xA1);
+    data[k] = TWDR;
+  }
+  status<S>(TW_ST_DATA_NACK);
+  return true;
+}
+
+template <class S, uint16_t Size, uint8_t MaxGroup>
+static void run(const char *name) {
+  uint8_t in[8], out[8];
+
+  memset(errors, 0, sizeof(errors));
+  memset(S::store, 0, Size);
+  S::setup(0x50);
+  CHECK(TWAR == 0x50 << 1);
+
+  // ungrouped bytes at the start and at the end
+  for (uint8_t k = 0; k < 8; k++)
+    in[k] = 0x11 * (k + 1);
+  CHECK(write<S>(0, 0, in, 3));
+  CHECK(memcmp(S::store, in, 3) == 0);
+  CHECK(read<S>(0, 0, out, 3) && memcmp(out, in, 3) == 0);
+  CHECK(write<S>(Size - 1, 0, in, 1));
+  CHECK(S::store[Size - 1] == in[0]);
+
+  // every group size up to MaxGroup, at the last aligned address that fits
+  for (uint8_t g = 2; g <= MaxGroup; g *= 2) {
+    uint16_t a = (Size - g) & ~(g - 1);
+    for (uint8_t k = 0; k < g; k++)
+      in[k] = g + k;
+    CHECK(write<S>(a, g, in, g));
+    CHECK(memcmp(&S::store[a], in, g) == 0);
+    CHECK(read<S>(a, g, out, g) && memcmp(out, in, g) == 0);
+  }
+  CHECK(errors[1] == 0 && errors[2] == 0);
+
+  // a group larger than the slave's buffer is NACKed
+  if (MaxGroup < 8) {
+    CHECK(!write<S>(0, MaxGroup * 2, in, MaxGroup * 2));
+    CHECK(errors[2] == 1);
+  }
+
+  // a misaligned group is NACKed
+  CHECK(!write<S>(1, 2, in, 2));
+  CHECK(errors[1] == 1);
+
+  // past the end: aligned groups are ACKed, read as 0 and ignore writes, even
+  // where Size isn't a multiple of the group size
+  for (uint8_t g = 2; g <= MaxGroup; g *= 2) {
+    uint16_t a = (Size + g - 1) & ~(g - 1);
+    memset(in, 0x5A, sizeof(in));
+    CHECK(write<S>(a, g, in, g));
+    CHECK(read<S>(a, g, out, g));
+    for (uint8_t k = 0; k < g; k++)
+      CHECK(out[k] == 0);
+  }
+  CHECK(errors[1] == 1);
+
+  // an aligned group that starts in range but runs past the end is out of
+  // range as a whole: it reads as 0, not what lies beyond the store
+  for (uint8_t g = 2; g <= MaxGroup; g *= 2) {
+    uint16_t a = Size & ~(g - 1);
+    if (a == Size)
+      continue;
+    memset(&S::store[a], 0x77, Size - a);
+    memset(in, 0x5A, sizeof(in));
+    CHECK(write<S>(a, g, in, g));
+    CHECK(read<S>(a, g, out, g));
+    for (uint8_t k = 0; k < g; k++)
+      CHECK(out[k] == 0);
+    for (uint16_t k = a; k < Size; k++)
+      CHECK(S::store[k] == 0x77);
+  }
+  CHECK(errors[1] == 1);
+
+  // the signal addresses (0xFFF8 - 0xFFFF) don't touch the store
+  uint8_t before = signals;
+  status<S>(TW_SR_SLA_ACK, 0xA0);
+  status<S>(TW_SR_DATA_ACK, 0xFD);
+  status<S>(TW_SR_DATA_ACK, 0xFF);
+  status<S>(TW_SR_STOP);
+  CHECK(signals == before + 1);
+}
+
+typedef Mem14Slave<10, 10, 4, TestHooks> small_g4;
+typedef Mem14Slave<64, 16, 8, TestHooks> small_g8;
+typedef Mem14Slave<127, 127, 2, TestHooks> small_g2;
+typedef Mem14Slave<200, 200, 8, TestHooks> large_g8;
+typedef Mem14Slave<1030, 1030, 4, TestHooks> large_g4;
+
+int main() {
+  run<small_g4, 10, 4>("Size 10, MaxGroup 4");
+  run<small_g2, 127, 2>("Size 127, MaxGroup 2");
+  run<large_g8, 200, 8>("Size 200, MaxGroup 8");
+  run<large_g4, 1030, 4>("Size 1030, MaxGroup 4");
+
+  // with WriteLen < Size, the read-only part ignores writes
+  {
+    const char *name = "Size 64, WriteLen 16";
+    uint8_t in[2] = { 1, 2 }, out[2];
+    small_g8::setup(0x51);
+    small_g8::store[32] = small_g8::store[33] = 7;
+    CHECK(write<small_g8>(32, 2, in, 2));
+    CHECK(read<small_g8>(32, 2, out, 2) && out[0] == 7 && out[1] == 7);
+    CHECK(write<small_g8>(14, 2, in, 2));
+    CHECK(small_g8::store[14] == 1 && small_g8::store[15] == 2);
+  }
+
+  printf("%u failures\n", failures);
+  return failures ? 1 : 0;
+}
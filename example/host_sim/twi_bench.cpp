@@ -0,0 +1,382 @@
+/* twi_bench: throughput of ../../TWIMaster.cpp against the device models in
+   twi_models.h on the simulated bus (twi_sim.h).
+
+     ./twi_bench [-t ms] [-p us] [-r div] [-a us] [-m us] [-i cycles]
+                 [-s dev=us] [-n dev=permille] [-S]
+
+   The main loop wakes every -p microseconds (1000) and:
+
+     reads the MPU-6050's FIFO_COUNT, then as many whole 12-byte accel + gyro
+     frames as fit in one transfer; the rate is 8kHz / (1 + div), div being -r (7)
+     every -a microseconds (10000; 0 for none), reads the AK8975's ST1 - ST2, then
+     starts its next measurement
+     every -m microseconds (5000; 0 for none), writes a 4-byte group to the
+     TWISlaveMem14.c node and reads it back
+
+   -i is the CPU clocks of the target charged for each TWI interrupt (200).
+   -s and -n set a device's clock stretching per byte and NACK injection; dev is
+   mpu, ak or mem. -S sweeps the MPU-6050 from 500Hz to 8kHz (div 15 to 0), for -t
+   milliseconds each, to find the highest sample rate the stack keeps up with.
+
+   Build with the target's OPTIONS (see the Makefile); with twiCallbacksPolled
+   the callbacks are run from the main loop, between polls.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "TWIMaster.h"
+#include "twi_sim.h"
+#include "twi_models.h"
+
+#ifdef USINGBUSLOAD
+void TWIBusLoadWarning(uint8_t percent) {}
+#endif
+
+#define US(us) ((uint64_t)(us) * (F_CPU / 1000000))
+
+#define MPU_FRAME 12 // accel and gyro
+#ifdef USINGBULK
+#define MPU_CHUNK (twiSimMPU6050::FIFO_SIZE / MPU_FRAME * MPU_FRAME)
+#else
+#define MPU_CHUNK (255 / MPU_FRAME * MPU_FRAME)
+#endif
+
+static twiSimMPU6050 mpu;
+static twiSimAK8975 ak;
+static twiSimMem14 mem;
+
+typedef struct {
+  uint32_t enqueued, done, errors, full, max_outstanding;
+  uint32_t mpu_frames, mpu_lost, mpu_resets;
+  uint32_t ak_read, ak_not_ready;
+  uint32_t mem_trips, mem_mismatches;
+} bench_t;
+
+static bench_t b;
+
+static bool enqueue(bool read, uint8_t addr, char *data, twi_len_t len, callback_fp donefunc) {
+  bool ok = read ? twiQ.enqueue_r(addr, data, len, donefunc) :
+                   twiQ.enqueue_w(addr, data, len, donefunc);
+  if (!ok) {
+    b.full++;
+    return false;
+  }
+
+  b.enqueued++;
+  if (b.enqueued - b.done > b.max_outstanding)
+    b.max_outstanding = b.enqueued - b.done;
+  return true;
+}
+
+// every donefunc starts with this; returns true on success
+static bool done(state_t *s) {
+  b.done++;
+  if (s->state & (1<<STATE_SUCCESS_BIT))
+    return true;
+  b.errors++;
+  return false;
+}
+
+static void done_only(state_t *s) {
+  done(s);
+}
+
+
+/* MPU-6050
+*/
+
+static char mpu_count_reg[] = { twiSimMPU6050::FIFO_COUNTH };
+static char mpu_fifo_reg[] = { twiSimMPU6050::FIFO_R_W };
+static char mpu_count[2];
+static char mpu_fifo[MPU_CHUNK];
+static bool mpu_busy;
+static uint16_t mpu_last;  // the sample counter of the last frame read
+static bool mpu_resync;    // ... which is to be taken from the next frame
+static uint8_t mpu_gen;    // counts FIFO resets
+static uint8_t mpu_read_gen; // mpu_gen when the FIFO_COUNT in flight was asked for
+
+static char mpu_init[][2] = {
+  { twiSimMPU6050::PWR_MGMT_1, 0x01 }, // awake, gyro X clock
+  { twiSimMPU6050::CONFIG, 0x00 },     // DLPF off: 8kHz
+  { twiSimMPU6050::SMPLRT_DIV, 7 },
+  { twiSimMPU6050::FIFO_EN, 0x78 },    // gyro X, Y, Z and accel
+  { twiSimMPU6050::USER_CTRL, 0x44 }   // FIFO_EN, FIFO_RESET; last, for mpu_reset_fifo()
+};
+
+static void mpu_reset_fifo();
+
+static void mpu_fifo_done(state_t *s) {
+  // frames from before a FIFO reset don't count
+  if (done(s) && mpu_read_gen == mpu_gen)
+    for (uint16_t k = 0; k < s->len; k += MPU_FRAME) {
+      uint16_t c = ((uint8_t)mpu_fifo[k] << 8) | (uint8_t)mpu_fifo[k + 1];
+
+      // every word of a frame is the sample counter; if they differ, the FIFO
+      // overflowed after FIFO_COUNT was read, and lost part of a frame
+      if (memcmp(&mpu_fifo[k], &mpu_fifo[k + 2], MPU_FRAME - 2) != 0) {
+        b.mpu_resets++;
+        mpu_reset_fifo();
+        break;
+      }
+      if (mpu_resync)
+        mpu_last = c - 1;
+      mpu_resync = false;
+      b.mpu_lost += (uint16_t)(c - mpu_last - 1);
+      mpu_last = c;
+      b.mpu_frames++;
+    }
+  mpu_busy = false;
+}
+
+static void mpu_count_done(state_t *s) {
+  if (!done(s)) {
+    mpu_busy = false;
+    return;
+  }
+
+  uint16_t n = ((uint8_t)mpu_count[0] << 8) | (uint8_t)mpu_count[1];
+  if (n >= twiSimMPU6050::FIFO_SIZE && mpu_read_gen == mpu_gen) {
+    // it has overflowed, and lost bytes rather than frames, so only a reset will
+    // get it back into step
+    b.mpu_resets++;
+    mpu_reset_fifo();
+    mpu_busy = false;
+    return;
+  }
+  n = n / MPU_FRAME * MPU_FRAME;
+  if (n > MPU_CHUNK)
+    n = MPU_CHUNK;
+
+  if (n == 0 || !enqueue(false, mpu.addr, mpu_fifo_reg, 1, done_only) ||
+                !enqueue(true, mpu.addr, mpu_fifo, n, mpu_fifo_done))
+    mpu_busy = false;
+}
+
+static void mpu_poll() {
+  if (mpu_busy)
+    return;
+  mpu_read_gen = mpu_gen;
+  mpu_busy = enqueue(false, mpu.addr, mpu_count_reg, 1, done_only) &&
+             enqueue(true, mpu.addr, mpu_count, 2, mpu_count_done);
+}
+
+static void mpu_reset_fifo() {
+  enqueue(false, mpu.addr, mpu_init[4], 2, done_only);
+  mpu_gen++;
+  mpu_resync = true;
+}
+
+// starts the MPU-6050 sampling at 8kHz / (1 + div), with an empty FIFO
+static void mpu_start(uint8_t div) {
+  mpu_init[2][1] = div;
+  for (uint8_t k = 0; k < 4; k++)
+    enqueue(false, mpu.addr, mpu_init[k], 2, done_only);
+  mpu_reset_fifo();
+}
+
+
+/* AK8975
+*/
+
+static char ak_st1_reg[] = { twiSimAK8975::ST1 };
+static char ak_single[] = { twiSimAK8975::CNTL, 0x01 };
+static char ak_data[8]; // ST1, HXL - HZH, ST2
+
+static void ak_done(state_t *s) {
+  if (!done(s))
+    return;
+
+  if (ak_data[0] & 0x01)
+    b.ak_read++;
+  else
+    b.ak_not_ready++;
+  enqueue(false, ak.addr, ak_single, 2, done_only);
+}
+
+static void ak_poll() {
+  if (enqueue(false, ak.addr, ak_st1_reg, 1, done_only))
+    enqueue(true, ak.addr, ak_data, sizeof(ak_data), ak_done);
+}
+
+
+/* TWISlaveMem14.c
+*/
+
+#define MEM_ADDR 0x10
+static char mem_w[6] = { MEM_ADDR, (char)0x80 }; // 4-byte groups; then the data
+static char mem_a[2] = { MEM_ADDR, (char)0x80 };
+static char mem_r[4];
+static uint8_t mem_n;
+
+static void mem_done(state_t *s) {
+  if (!done(s))
+    return;
+
+  b.mem_trips++;
+  if (memcmp(mem_r, &mem_w[2], 4) != 0)
+    b.mem_mismatches++;
+}
+
+static void mem_poll() {
+  for (uint8_t k = 0; k < 4; k++)
+    mem_w[2 + k] = mem_n + k;
+  mem_n += 4;
+
+  if (enqueue(false, mem.addr, mem_w, 6, done_only) &&
+      enqueue(false, mem.addr, mem_a, 2, done_only))
+    enqueue(true, mem.addr, mem_r, 4, mem_done);
+}
+
+
+/* Running
+*/
+
+static uint32_t poll_us = 1000, ak_us = 10000, mem_us = 5000;
+static uint64_t next_ak, next_mem;
+
+static void run(uint64_t cycles) {
+  uint64_t end = sim_now() + cycles;
+
+  while (sim_now() < end) {
+    uint64_t now = sim_now();
+
+    mpu_poll();
+    if (ak_us != 0 && now >= next_ak) {
+      ak_poll();
+      next_ak = now + US(ak_us);
+    }
+    if (mem_us != 0 && now >= next_mem) {
+      mem_poll();
+      next_mem = now + US(mem_us);
+    }
+
+    uint64_t until = now + US(poll_us);
+    sim_run(until < end ? until : end);
+    twiQ.run_callbacks();
+  }
+}
+
+static twiSimDevice *device(const char *name) {
+  if (strcmp(name, "mpu") == 0)
+    return &mpu;
+  if (strcmp(name, "ak") == 0)
+    return &ak;
+  if (strcmp(name, "mem") == 0)
+    return &mem;
+  fprintf(stderr, "no device %s (mpu, ak or mem)\n", name);
+  exit(2);
+}
+
+// dev=value
+static twiSimDevice *device_arg(char *arg, uint32_t *value) {
+  char *eq = strchr(arg, '=');
+  if (eq == NULL) {
+    fprintf(stderr, "expected dev=value, not %s\n", arg);
+    exit(2);
+  }
+  *eq = '\0';
+  *value = strtoul(eq + 1, NULL, 0);
+  return device(arg);
+}
+
+static void report(const char *name, const bench_t *d, const twi_sim_stats_t *s, uint64_t cycles) {
+  double ms = cycles * 1000.0 / F_CPU;
+
+  printf("%s%.1f ms: bus %.1f%% busy, %u STARTs, %u bytes (%.1f kB/s), %u NACKs, %u timeouts\n",
+         name, ms, 100.0 * s->busy / cycles, s->starts, s->bytes, s->bytes / ms,
+         s->nacks, s->timeouts);
+  printf("  queue: %u commands, %u failed, %u full, max %u outstanding\n",
+         d->enqueued, d->errors, d->full, d->max_outstanding);
+  printf("  mpu6050: %u frames (%.0f/s), %u lost, %u FIFO resets after overflowing\n",
+         d->mpu_frames, d->mpu_frames * 1000.0 / ms, d->mpu_lost, d->mpu_resets);
+  if (ak_us != 0)
+    printf("  ak8975: %u read, %u not ready\n", d->ak_read, d->ak_not_ready);
+  if (mem_us != 0)
+    printf("  mem14: %u round trips, %u mismatches\n", d->mem_trips, d->mem_mismatches);
+}
+
+int main(int argc, char **argv) {
+  uint32_t ms = 1000, div = 7, v;
+  bool sweep = false;
+  twiSimDevice *d;
+  int opt;
+
+  sim_isr_cycles = 200;
+
+  while ((opt = getopt(argc, argv, "t:p:r:a:m:i:s:n:S")) != -1) {
+    switch (opt) {
+      case 't': ms = strtoul(optarg, NULL, 0); break;
+      case 'p': poll_us = strtoul(optarg, NULL, 0); break;
+      case 'r': div = strtoul(optarg, NULL, 0); break;
+      case 'a': ak_us = strtoul(optarg, NULL, 0); break;
+      case 'm': mem_us = strtoul(optarg, NULL, 0); break;
+      case 'i': sim_isr_cycles = strtoul(optarg, NULL, 0); break;
+      case 's': d = device_arg(optarg, &v); d->stretch = US(v); break;
+      case 'n': d = device_arg(optarg, &v); d->nack_permille = v; break;
+      case 'S': sweep = true; break;
+      default:
+        fprintf(stderr, "usage: %s [-t ms] [-p us] [-r div] [-a us] [-m us] [-i cycles] "
+                        "[-s dev=us] [-n dev=permille] [-S]\n", argv[0]);
+        return 2;
+    }
+  }
+  if (poll_us == 0)
+    poll_us = 1;
+
+  sim_attach(&mpu);
+  sim_attach(&ak);
+  sim_attach(&mem);
+
+  i2c_master_initialize();
+  sei();
+
+  printf("SCL %u Hz, %u clocks per TWI interrupt, %u byte transfers at most\n",
+         twi_scl(F_CPU, TWBR, TWSR & 3), sim_isr_cycles, MPU_CHUNK);
+
+  struct timespec t0, t1;
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+
+  uint32_t from = sweep ? 15 : div, to = sweep ? 0 : div;
+  for (uint32_t r = from; ; r--) {
+    // let the configuration and the FIFO reset through before measuring
+    mpu_start(r);
+    run(US(2 * poll_us));
+
+    bench_t b0 = b;
+    twi_sim_stats_t s0 = sim_stats;
+    uint64_t start = sim_now();
+
+    run(US(ms * 1000));
+
+    bench_t db;
+    twi_sim_stats_t ds;
+    uint32_t *p = (uint32_t *)&db;
+    for (uint8_t k = 0; k < sizeof(b) / sizeof(uint32_t); k++)
+      p[k] = ((uint32_t *)&b)[k] - ((uint32_t *)&b0)[k];
+    db.max_outstanding = b.max_outstanding;
+    ds.busy = sim_stats.busy - s0.busy;
+    ds.starts = sim_stats.starts - s0.starts;
+    ds.bytes = sim_stats.bytes - s0.bytes;
+    ds.nacks = sim_stats.nacks - s0.nacks;
+    ds.timeouts = sim_stats.timeouts - s0.timeouts;
+
+    char name[32];
+    snprintf(name, sizeof(name), "%u Hz, ", 8000 / (1 + r));
+    report(name, &db, &ds, sim_now() - start);
+
+    if (r == to)
+      break;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  double host = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+  printf("mpu6050 %u FIFO overflows, ak8975 %u stale reads, mem14 %u slave errors, "
+         "%u + %u + %u NACKs injected\n",
+         mpu.overflows, ak.stale_reads, mem.user_errors,
+         mpu.nacks_injected, ak.nacks_injected, mem.nacks_injected);
+  printf("%.2f s on this PC, %.1fx real time\n", host, sim_now() / (double)F_CPU / host);
+  return 0;
+}
@@ -0,0 +1,289 @@
+#include <string.h>
+#include <avr/io.h>
+#include <util/twi.h>
+#include "twi_models.h"
+
+
+/* MPU-6050
+*/
+
+twiSimMPU6050::twiSimMPU6050(uint8_t addr) :
+  twiSimDevice(addr), samples(0), overflows(0)
+{
+  reset();
+}
+
+void twiSimMPU6050::reset() {
+  memset(regs, 0, sizeof(regs));
+  regs[WHO_AM_I] = 0x68;
+  regs[PWR_MGMT_1] = 0x40; // SLEEP
+  ptr = 0;
+  ptr_next = false;
+  fifo_head = fifo_count = 0;
+  next_sample = 0;
+}
+
+bool twiSimMPU6050::start(bool read) {
+  ptr_next = !read;
+  return true;
+}
+
+bool twiSimMPU6050::write(uint8_t b) {
+  if (ptr_next) {
+    ptr = b & 0x7F;
+    ptr_next = false;
+    return true;
+  }
+
+  switch (ptr) {
+    case FIFO_R_W:
+      push(b);
+      return true; // the pointer stays on FIFO_R_W
+    case USER_CTRL:
+      if (b & 0x04) // FIFO_RESET, which clears itself
+        fifo_head = fifo_count = 0;
+      regs[ptr] = b & ~0x04;
+      break;
+    case PWR_MGMT_1:
+      if (b & 0x80) { // DEVICE_RESET
+        reset();
+        return true;
+      }
+      regs[ptr] = b;
+      break;
+    case INT_STATUS:
+    case FIFO_COUNTH:
+    case FIFO_COUNTL:
+    case WHO_AM_I:
+      break; // read-only
+    default:
+      regs[ptr] = b;
+  }
+
+  ptr = (ptr + 1) & 0x7F;
+  return true;
+}
+
+uint8_t twiSimMPU6050::read(bool ack) {
+  uint8_t v;
+
+  switch (ptr) {
+    case FIFO_R_W:
+      if (fifo_count == 0)
+        return 0;
+      v = fifo[fifo_head];
+      fifo_head = (fifo_head + 1) % FIFO_SIZE;
+      fifo_count--;
+      return v; // the pointer stays on FIFO_R_W
+    case FIFO_COUNTH:
+      v = fifo_count >> 8;
+      break;
+    case FIFO_COUNTL:
+      v = fifo_count & 0xFF;
+      break;
+    case INT_STATUS:
+      v = regs[ptr];
+      regs[ptr] = 0; // cleared by reading
+      break;
+    default:
+      v = regs[ptr];
+  }
+
+  ptr = (ptr + 1) & 0x7F;
+  return v;
+}
+
+uint64_t twiSimMPU6050::sample_cycles() {
+  if (regs[PWR_MGMT_1] & 0x40)
+    return 0;
+
+  // the gyro output rate is 8kHz with the DLPF off (DLPF_CFG 0 or 7), else 1kHz
+  uint8_t dlpf = regs[CONFIG] & 7;
+  uint32_t base = (dlpf == 0 || dlpf == 7) ? 8000 : 1000;
+  return (uint64_t)F_CPU * (1 + regs[SMPLRT_DIV]) / base;
+}
+
+void twiSimMPU6050::tick(uint64_t now) {
+  uint64_t c = sample_cycles();
+
+  if (c == 0) {
+    next_sample = 0;
+    return;
+  }
+  if (next_sample == 0)
+    next_sample = now + c;
+
+  while (now >= next_sample) {
+    sample();
+    next_sample += c;
+  }
+}
+
+void twiSimMPU6050::push(uint8_t b) {
+  if (fifo_count == FIFO_SIZE) { // the oldest byte is lost
+    fifo_head = (fifo_head + 1) % FIFO_SIZE;
+    fifo_count--;
+  }
+  fifo[(fifo_head + fifo_count) % FIFO_SIZE] = b;
+  fifo_count++;
+}
+
+void twiSimMPU6050::sample() {
+  samples++;
+
+  // ACCEL_[XYZ]OUT, TEMP_OUT and GYRO_[XYZ]OUT, big-endian
+  for (uint8_t k = 0; k < 14; k += 2) {
+    regs[ACCEL_XOUT_H + k] = samples >> 8;
+    regs[ACCEL_XOUT_H + k + 1] = samples & 0xFF;
+  }
+  regs[INT_STATUS] |= 0x01; // DATA_RDY_INT
+
+  if (!(regs[USER_CTRL] & 0x40)) // FIFO_EN
+    return;
+
+  // in register order: accel (ACCEL_FIFO_EN), temp (TEMP_FIFO_EN), then gyro X, Y and Z
+  uint8_t en = regs[FIFO_EN];
+  static const struct { uint8_t bit, reg, len; } blocks[] = {
+    { 3, 0x3B, 6 }, { 7, 0x41, 2 }, { 6, 0x43, 2 }, { 5, 0x45, 2 }, { 4, 0x47, 2 }
+  };
+  uint8_t n = 0;
+  for (uint8_t k = 0; k < 5; k++)
+    if (en & (1 << blocks[k].bit))
+      n += blocks[k].len;
+
+  if (fifo_count + n > FIFO_SIZE) {
+    overflows++;
+    regs[INT_STATUS] |= 0x10; // FIFO_OFLOW_INT
+  }
+  for (uint8_t k = 0; k < 5; k++)
+    if (en & (1 << blocks[k].bit))
+      for (uint8_t j = 0; j < blocks[k].len; j++)
+        push(regs[blocks[k].reg + j]);
+}
+
+
+/* AK8975
+*/
+
+twiSimAK8975::twiSimAK8975(uint8_t addr) :
+  twiSimDevice(addr), measure_cycles((uint64_t)F_CPU * 73 / 10000),
+  measurements(0), stale_reads(0), ptr(0), ptr_next(false), now(0), ready_at(0)
+{
+  memset(regs, 0, sizeof(regs));
+  regs[WIA] = 0x48;
+  regs[0x10] = regs[0x11] = regs[0x12] = 0x80; // ASAX-Z: a sensitivity adjustment of 1
+}
+
+bool twiSimAK8975::start(bool read) {
+  ptr_next = !read;
+  return true;
+}
+
+bool twiSimAK8975::write(uint8_t b) {
+  if (ptr_next) {
+    ptr = b;
+    ptr_next = false;
+    return true;
+  }
+
+  if (ptr == CNTL) {
+    regs[CNTL] = b & 0x0F;
+    if ((b & 0x0F) == 1 && ready_at == 0) // single measurement
+      ready_at = now + measure_cycles;
+  }
+
+  ptr = (ptr + 1) % sizeof(regs);
+  return true;
+}
+
+uint8_t twiSimAK8975::read(bool ack) {
+  uint8_t v = regs[ptr];
+
+  if (ptr >= HXL && ptr <= ST2) {
+    if (ptr == HXL && !(regs[ST1] & 0x01))
+      stale_reads++;
+    regs[ST1] &= ~0x01; // DRDY is cleared by reading the data or ST2
+  }
+
+  ptr = (ptr + 1) % sizeof(regs);
+  return v;
+}
+
+void twiSimAK8975::tick(uint64_t now_) {
+  now = now_;
+
+  if (ready_at != 0 && now >= ready_at) {
+    measurements++;
+    for (uint8_t k = 0; k < 6; k += 2) { // HXL-HZH, little-endian
+      regs[HXL + k] = measurements & 0xFF;
+      regs[HXL + k + 1] = measurements >> 8;
+    }
+    regs[ST1] |= 0x01;    // DRDY
+    regs[CNTL] = 0;       // back to power-down
+    ready_at = 0;
+  }
+}
+
+
+/* TWISlaveMem14.c
+*/
+
+extern "C" {
+void setup(uint8_t addr, uint8_t* bs, int rlen, int wlen);
+void twi_slave_isr(void);
+void TWIUserError(uint8_t);
+void TWIUserSignal(uint8_t);
+}
+
+static twiSimMem14 *mem14;
+
+void TWIUserError(uint8_t e) {
+  if (mem14 != NULL)
+    mem14->user_errors++;
+}
+
+void TWIUserSignal(uint8_t sig) {}
+
+twiSimMem14::twiSimMem14(uint8_t addr) :
+  twiSimDevice(addr), user_errors(0), receiving(false)
+{
+  memset(store, 0, sizeof(store));
+  mem14 = this;
+  setup(addr, store, STORE_SIZE, STORE_SIZE);
+}
+
+void twiSimMem14::slave_isr(uint8_t status, uint8_t data) {
+  host_slave_TWSR = status;
+  host_slave_TWDR = data;
+  twi_slave_isr();
+}
+
+bool twiSimMem14::start(bool read) {
+  // the hardware only ACKs its address with TWEA set
+  if (!(host_slave_TWCR & (1<<TWEA)))
+    return false;
+
+  receiving = !read;
+  slave_isr(read ? TW_ST_SLA_ACK : TW_SR_SLA_ACK, (addr << 1) | read);
+  return true;
+}
+
+bool twiSimMem14::write(uint8_t b) {
+  // ... and ACKs data the same way
+  bool ack = (host_slave_TWCR & (1<<TWEA)) != 0;
+  slave_isr(ack ? TW_SR_DATA_ACK : TW_SR_DATA_NACK, b);
+  return ack;
+}
+
+uint8_t twiSimMem14::read(bool ack) {
+  uint8_t b = host_slave_TWDR;
+  slave_isr(!ack ? TW_ST_DATA_NACK :
+            (host_slave_TWCR & (1<<TWEA)) ? TW_ST_DATA_ACK : TW_ST_LAST_DATA, b);
+  return b;
+}
+
+void twiSimMem14::stop() {
+  if (receiving)
+    slave_isr(TW_SR_STOP, 0);
+  receiving = false;
+}
@@ -0,0 +1,100 @@
+#ifndef twi_models_h
+#define twi_models_h
+
+#include <stdint.h>
+#include "twi_sim.h"
+
+/* Behavioural models of the devices in this repo, for the simulated bus in
+   twi_sim.h. Each has twiSimDevice's stretch and nack_permille for clock
+   stretching and NACK injection.
+*/
+
+// MPU-6050 (or the MPU-9150's accel/gyro) at 0x68: the register file with an
+// auto-incrementing register pointer, and the 1024-byte FIFO filled at the
+// sample rate set by SMPLRT_DIV and CONFIG's DLPF_CFG. Samples are a counter,
+// so a reader can check that none were lost.
+class twiSimMPU6050 : public twiSimDevice {
+public:
+  enum {
+    SMPLRT_DIV = 0x19, CONFIG = 0x1A, FIFO_EN = 0x23, INT_STATUS = 0x3A,
+    ACCEL_XOUT_H = 0x3B, USER_CTRL = 0x6A, PWR_MGMT_1 = 0x6B,
+    FIFO_COUNTH = 0x72, FIFO_COUNTL = 0x73, FIFO_R_W = 0x74, WHO_AM_I = 0x75
+  };
+  enum { FIFO_SIZE = 1024 };
+
+  uint8_t regs[128];
+  uint32_t samples;   // taken since the start
+  uint32_t overflows; // samples that pushed older bytes out of a full FIFO
+
+  twiSimMPU6050(uint8_t addr = 0x68);
+
+  bool start(bool read);
+  bool write(uint8_t b);
+  uint8_t read(bool ack);
+  void tick(uint64_t now);
+
+  // CPU clocks per sample, or 0 if asleep
+  uint64_t sample_cycles();
+
+private:
+  uint8_t ptr;
+  bool ptr_next; // the next byte written is the register pointer
+  uint8_t fifo[FIFO_SIZE];
+  uint16_t fifo_head, fifo_count;
+  uint64_t next_sample;
+
+  void reset();
+  void sample();
+  void push(uint8_t b);
+};
+
+// AK8975 magnetometer at 0x0C: a single measurement (CNTL = 1) takes
+// measure_cycles, after which ST1's DRDY is set until the data or ST2 are read
+class twiSimAK8975 : public twiSimDevice {
+public:
+  enum { WIA = 0x00, ST1 = 0x02, HXL = 0x03, ST2 = 0x09, CNTL = 0x0A };
+
+  uint8_t regs[0x13];
+  uint64_t measure_cycles; // 7.3ms (typical) by default
+  uint32_t measurements;   // completed
+  uint32_t stale_reads;    // data read while DRDY was clear
+
+  twiSimAK8975(uint8_t addr = 0x0C);
+
+  bool start(bool read);
+  bool write(uint8_t b);
+  uint8_t read(bool ack);
+  void tick(uint64_t now);
+
+private:
+  uint8_t ptr;
+  bool ptr_next;
+  uint64_t now;
+  uint64_t ready_at; // 0 if not measuring
+};
+
+// a ../../TWISlaveMem14.c node: the real slave state machine (twi_slave_isr(),
+// built with -DTWI_DUAL_ROLE -DHOST_TWI_SLAVE), over store[], driven through
+// its own set of TWI registers
+class twiSimMem14 : public twiSimDevice {
+public:
+  enum { STORE_SIZE = 256 };
+
+  uint8_t store[STORE_SIZE];
+  uint32_t user_errors; // TWIUserError calls
+
+  // only one of these can exist, as TWISlaveMem14.c's state is global
+  twiSimMem14(uint8_t addr = 0x50);
+
+  bool start(bool read);
+  bool write(uint8_t b);
+  uint8_t read(bool ack);
+  void stop();
+
+private:
+  bool receiving; // addressed with SLA+W, so a STOP or repeated START is its business
+
+  void slave_isr(uint8_t status, uint8_t data);
+};
+
+#endif // #ifndef twi_models_h
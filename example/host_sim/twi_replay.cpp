@@ -0,0 +1,161 @@
+/* twi_replay: feeds a twiTraceRecord dump (twi_serial_bridge's 'r' command, see
+   ../twi_serial_bridge/API.md) back through ../../TWIMaster.cpp on a PC.
+
+     ./twi_replay dump.txt
+
+   Each line of the dump is "CC DD LL TTTT" (lines that aren't are skipped):
+
+     CC == 1F  a command was enqueued: DD is SLA+R/W, LL its length; it is
+               enqueued again here, into a scratch buffer
+     CC == 17  the timeout timer fired: TWI_TIMER_vect is called
+     otherwise CC is TWSR on entry to the TWI ISR and DD is TWDR: they are put
+               in the registers and TWI_vect is called
+
+   Flags aren't recorded, so PEC, block read, quick and 10-bit commands are
+   replayed as plain reads and writes. Build with the same OPTIONS as the target
+   (see the Makefile), or the master will take other paths through its states.
+
+   The report has, for each code, how many times it was replayed, how long the
+   handler took on this PC, and the recorded gaps leading up to it on the target;
+   then the callbacks by state, and any point at which the master's register
+   writes don't agree with what happened next on the target (the recording
+   diverges from what this build of TWIMaster.cpp would do).
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <util/twi.h>
+#include "TWIMaster.h"
+
+extern "C" void TWI_vect(void);
+extern "C" void TWI_TIMER_vect(void);
+
+#ifdef USINGBUSLOAD
+void TWIBusLoadWarning(uint8_t percent) {}
+#endif
+
+#define CODE_ENQUEUE TWI_TRACE_CODE(TWI_TRACE_ENQUEUE)
+#define CODE_TIMEOUT TWI_TRACE_CODE(TWI_TRACE_TIMEOUT)
+
+// one for each entry that can be in the queue at once
+static char scratch[TWI_QUEUE_SIZE][256];
+static uint8_t next_scratch;
+
+static uint32_t callbacks[256]; // by state_s.state
+
+typedef struct {
+  uint32_t n;
+  uint64_t ns_sum, ns_max;     // time in the handler on this PC
+  uint64_t ticks_sum, ticks_max; // TWI_STAMP_TIMER ticks since the previous record
+} code_stats_t;
+
+static code_stats_t stats[256];
+static uint32_t divergences;
+
+static void replay_donefunc(state_t *s) {
+  callbacks[(uint8_t)s->state]++;
+}
+
+static uint64_t now_ns() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static void diverged(uint32_t line, const char *why) {
+  printf("line %u: %s (TWCR=0x%02X)\n", line, why, TWCR);
+  divergences++;
+}
+
+static void replay(uint32_t line, uint8_t code, uint8_t data, uint8_t len) {
+  if (code == CODE_ENQUEUE) {
+    char *p = scratch[next_scratch++ % TWI_QUEUE_SIZE];
+    bool ok = data & (1<<TWI_READ_BIT) ?
+      twiQ.enqueue_r(data >> TWI_ADR_BITS, p, len, replay_donefunc) :
+      twiQ.enqueue_w(data >> TWI_ADR_BITS, p, len, replay_donefunc);
+    if (!ok)
+      diverged(line, "queue full");
+  } else if (code == CODE_TIMEOUT) {
+    if (!(twiTimerRegs<TWI_TIMER>::timsk() & (1<<twiTimerRegs<TWI_TIMER>::ocie)))
+      diverged(line, "timeout with the timer disabled");
+    TWI_TIMER_vect();
+  } else {
+    if ((code == TW_START || code == TW_REP_START) && !(TWCR & (1<<TWSTA)))
+      diverged(line, "START without TWSTA");
+    #ifndef USINGSLAVE
+    else if (!(TWCR & (1<<TWIE)))
+      diverged(line, "TWI interrupt with TWIE clear");
+    #endif
+    TWSR = code | TWI_TWPS;
+    TWDR = data;
+    TWI_vect();
+  }
+}
+
+int main(int argc, char **argv) {
+  if (argc != 2) {
+    fprintf(stderr, "usage: %s dump.txt\n", argv[0]);
+    return 2;
+  }
+
+  FILE *f = fopen(argv[1], "r");
+  if (f == NULL) {
+    perror(argv[1]);
+    return 1;
+  }
+
+  i2c_master_initialize();
+  sei();
+
+  char buffer[128];
+  uint32_t line = 0, records = 0;
+  uint16_t t_last = 0;
+
+  while (fgets(buffer, sizeof(buffer), f) != NULL) {
+    unsigned code, data, len, t;
+    line++;
+    if (sscanf(buffer, "%2x %2x %2x %4x", &code, &data, &len, &t) != 4)
+      continue;
+
+    uint64_t t0 = now_ns();
+    replay(line, code, data, len);
+    uint64_t ns = now_ns() - t0;
+
+    code_stats_t *s = &stats[code];
+    uint16_t ticks = records > 0 ? (uint16_t)(t - t_last) : 0;
+    s->n++;
+    s->ns_sum += ns;
+    s->ns_max = ns > s->ns_max ? ns : s->ns_max;
+    s->ticks_sum += ticks;
+    s->ticks_max = ticks > s->ticks_max ? ticks : s->ticks_max;
+
+    t_last = t;
+    records++;
+  }
+  fclose(f);
+
+  // TWI_STAMP_CS is /8; the timer wraps every 2^16 ticks, so longer gaps alias
+  const double us_per_tick = 8e6 / F_CPU;
+
+  printf("%u records\n", records);
+  printf("code     n   host ns (mean, max)   gap before, us (mean, max)\n");
+  for (unsigned c = 0; c < 256; c++) {
+    code_stats_t *s = &stats[c];
+    if (s->n == 0)
+      continue;
+    printf("%02X %8u %10.0f %10llu %14.1f %10.1f%s\n", c, s->n,
+           (double)s->ns_sum / s->n, (unsigned long long)s->ns_max,
+           s->ticks_sum * us_per_tick / s->n, s->ticks_max * us_per_tick,
+           c == CODE_ENQUEUE ? "  enqueue" : c == CODE_TIMEOUT ? "  timeout" : "");
+  }
+
+  printf("callbacks by state\n");
+  for (unsigned c = 0; c < 256; c++)
+    if (callbacks[c] != 0)
+      printf("%02X %8u\n", c, callbacks[c]);
+
+  printf("%u divergences\n", divergences);
+  return divergences != 0;
+}
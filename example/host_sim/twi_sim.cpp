@@ -0,0 +1,397 @@
+#include <stdio.h>
+#include <util/twi.h>
+#include "TWIMaster.h"
+#include "twi_sim.h"
+
+extern "C" void TWI_vect(void);
+extern "C" void TWI_TIMER_vect(void);
+#ifdef USINGBUSLOAD
+extern "C" void TWI_STAMP_OVF_vect(void);
+#endif
+
+#define TWI_TIMER_TCCRB TWI_PASTE3_X(TCCR, TWI_TIMER, B)
+#define TWI_STAMP_TCCRB TWI_PASTE3_X(TCCR, TWI_STAMP_TIMER, B)
+
+#define NEVER UINT64_MAX
+
+twi_sim_stats_t sim_stats;
+uint32_t sim_isr_cycles;
+uint8_t (*sim_fault)(uint8_t status);
+twi_sim_rival_t *sim_rival;
+
+static uint64_t now;
+
+// calls an interrupt vector: the I bit is clear while it runs, and restored
+// as it returns, as RETI would
+static void vector(void (*v)(void)) {
+  uint8_t sreg = SREG;
+  cli();
+  v();
+  SREG = sreg;
+}
+
+static twiSimDevice *devices[TWI_SIM_DEVICES];
+static uint8_t ndevices;
+
+bool twiSimDevice::inject_nack() {
+  if (nack_permille == 0)
+    return false;
+
+  rng = rng * 1103515245u + 12345u;
+  if ((rng >> 16) % 1000 >= nack_permille)
+    return false;
+
+  nacks_injected++;
+  return true;
+}
+
+void sim_attach(twiSimDevice *d) {
+  if (ndevices < TWI_SIM_DEVICES)
+    devices[ndevices++] = d;
+}
+
+uint64_t sim_now() {
+  return now;
+}
+
+
+/* Timers
+*/
+
+// TimerN counting CPU clocks at the divider its clock select bits give, with
+// OCRnA as TOP in CTC mode or counting to its max in normal mode
+template <uint8_t N, bool CTC>
+class simTimer {
+  typedef twiTimerRegs<N> regs;
+
+  volatile uint8_t &tccrb;
+  uint32_t rem; // CPU clocks counted towards the next tick
+
+public:
+  simTimer(volatile uint8_t &tccrb_) : tccrb(tccrb_), rem(0) {}
+
+  // log2 of the divider, or 0xFF if stopped
+  uint8_t shift() {
+    static const uint8_t s[8] = { 0xFF, regs::s1, regs::s2, regs::s3, regs::s4, regs::s5, regs::s6, regs::s7 };
+    return s[tccrb & 7];
+  }
+
+  uint32_t top() {
+    return CTC ? regs::ocra() : regs::max;
+  }
+
+  // CPU clocks until the count next reaches TOP (CTC) or wraps to 0 (normal),
+  // or NEVER if the timer is stopped or its interrupt is off
+  uint64_t until_event() {
+    uint8_t s = shift();
+    if (s == 0xFF || !(regs::timsk() & (1 << (CTC ? regs::ocie : regs::toie))))
+      return NEVER;
+
+    uint32_t t = regs::tcnt();
+    uint32_t ticks;
+    if (CTC)
+      ticks = t < top() ? top() - t : t == top() ? top() + 1 : regs::max - t + 1 + top();
+    else
+      ticks = regs::max - t + 1;
+
+    return ((uint64_t)ticks << s) - rem;
+  }
+
+  void advance(uint64_t cycles) {
+    uint8_t s = shift();
+    if (s == 0xFF)
+      return;
+
+    uint64_t total = rem + cycles;
+    uint64_t ticks = total >> s;
+    rem = total & ((1u << s) - 1);
+
+    uint64_t t = regs::tcnt() + ticks;
+    if (CTC && regs::tcnt() <= top())
+      t %= top() + 1;
+    else if (t > regs::max)
+      t = CTC ? (t - regs::max - 1) % (top() + 1) : t & regs::max;
+    regs::tcnt() = t;
+  }
+};
+
+static simTimer<TWI_TIMER, true> timeout(TWI_TIMER_TCCRB);
+static simTimer<TWI_STAMP_TIMER, false> stamps(TWI_STAMP_TCCRB);
+
+
+/* The bus
+*/
+
+enum { BUS_IDLE, BUS_ADDR, BUS_MT, BUS_MR, BUS_RIVAL };
+
+static uint8_t phase = BUS_IDLE;
+static twiSimDevice *dev; // the device addressed, if it ACKed
+
+static twiSimDevice *find(uint8_t addr) {
+  for (uint8_t k = 0; k < ndevices; k++)
+    if (devices[k]->addr == addr)
+      return devices[k];
+  return NULL;
+}
+
+static void end_transfer() {
+  if (dev != NULL)
+    dev->stop();
+  dev = NULL;
+}
+
+static void release_bus() {
+  end_transfer();
+  phase = BUS_IDLE;
+}
+
+// lets cycles CPU clocks pass; returns true if the timeout fired meanwhile,
+// in which case the master has reset the TWI and the bus is released
+static bool advance(uint64_t cycles) {
+  bool timed_out = false;
+
+  while (cycles > 0) {
+    uint64_t step = cycles;
+    uint64_t t_timeout = timeout.until_event();
+    uint64_t t_stamp = NEVER;
+  #ifdef USINGBUSLOAD
+    t_stamp = stamps.until_event();
+  #endif
+
+    if (t_timeout < step)
+      step = t_timeout;
+    if (t_stamp < step)
+      step = t_stamp;
+
+    timeout.advance(step);
+    stamps.advance(step);
+    now += step;
+    if (phase != BUS_IDLE)
+      sim_stats.busy += step;
+    cycles -= step;
+
+    if (step == t_timeout) {
+      sim_stats.timeouts++;
+      vector(TWI_TIMER_vect);
+      release_bus();
+      timed_out = true;
+    }
+  #ifdef USINGBUSLOAD
+    if (step == t_stamp)
+      vector(TWI_STAMP_OVF_vect);
+  #endif
+  }
+
+  return timed_out;
+}
+
+// the hardware sets TWINT with TWSR = status
+static void deliver(uint8_t status, uint8_t data) {
+  TWSR = status | (TWSR & ((1<<TWPS1) | (1<<TWPS0)));
+  TWDR = data;
+
+  for (uint8_t n = 0; TWCR & (1<<TWIE); n++) {
+    if (n == TWI_SIM_STORM) {
+      sim_stats.storms++;
+      break;
+    }
+
+    vector(TWI_vect);
+    if (advance(sim_isr_cycles))
+      break;
+
+    // TWINT was written (cleared), or the TWI switched off
+    if ((TWCR & (1<<TWINT)) || !(TWCR & (1<<TWEN)))
+      break;
+  }
+}
+
+// ... unless sim_fault has another status in mind
+static void interrupt(uint8_t status, uint8_t data) {
+  if (sim_fault != NULL) {
+    status = sim_fault(status);
+    if (status == TWI_SIM_HANG)
+      return;
+    if (status == TW_BUS_ERROR || status == TW_MT_ARB_LOST || status >= TW_SR_SLA_ACK)
+      release_bus();
+  }
+
+  deliver(status, data);
+}
+
+// an address or data byte, and its ACK bit
+static bool byte_time(bool ack) {
+  sim_stats.bytes++;
+  if (!ack)
+    sim_stats.nacks++;
+
+  uint64_t cycles = 9 * (uint64_t)twi_scl_cycles(TWBR, TWSR & ((1<<TWPS1) | (1<<TWPS0)));
+  if (dev != NULL) {
+    dev->bytes++;
+    cycles += dev->stretch;
+  }
+  return advance(cycles);
+}
+
+// sim_rival's transfer, in place of the master's address byte; the master's
+// slave ACKs with TWEA, as it was when its ISR last cleared TWINT
+static void rival() {
+  twi_sim_rival_t *r = sim_rival;
+  bool read = r->sla & 1, gcall = (r->sla >> 1) == 0;
+  bool addressed = gcall ? (TWAR & (1<<TWGCE)) != 0 : (r->sla >> 1) == (TWAR >> 1);
+
+  sim_rival = NULL;
+  r->done = 0;
+  r->finished = false;
+  end_transfer();
+  phase = BUS_RIVAL;
+
+  if (byte_time(addressed))
+    return;
+  deliver(!addressed ? TW_MT_ARB_LOST :
+          read ? TW_ST_ARB_LOST_SLA_ACK :
+          gcall ? TW_SR_ARB_LOST_GCALL_ACK : TW_SR_ARB_LOST_SLA_ACK, r->sla);
+
+  for (uint8_t k = 0; k < r->len; k++) {
+    bool ea = addressed && (TWCR & (1<<TWEA));
+
+    if (read) {
+      // the slave loaded TWDR before clearing TWINT; nobody drives SDA otherwise
+      bool last = k == r->len - 1;
+      r->data[k] = addressed ? TWDR : 0xFF;
+      if (byte_time(!last))
+        return;
+      if (addressed) {
+        r->done++;
+        deliver(last ? TW_ST_DATA_NACK : ea ? TW_ST_DATA_ACK : TW_ST_LAST_DATA, r->data[k]);
+        addressed = !last && ea;
+      }
+    } else {
+      // a NACK ends the write
+      if (byte_time(ea))
+        return;
+      if (addressed) {
+        r->done += ea;
+        deliver(gcall ? (ea ? TW_SR_GCALL_DATA_ACK : TW_SR_GCALL_DATA_NACK) :
+                        (ea ? TW_SR_DATA_ACK : TW_SR_DATA_NACK), r->data[k]);
+      }
+      if (!ea)
+        break;
+    }
+  }
+
+  // the STOP; a slave that is still addressed (a write's) sees it
+  if (advance(twi_scl_cycles(TWBR, TWSR & ((1<<TWPS1) | (1<<TWPS0)))))
+    return;
+  release_bus();
+  r->finished = true;
+  if (addressed && !read)
+    deliver(TW_SR_STOP, 0);
+}
+
+// carries out what the master last wrote to TWCR; returns false if that was nothing
+static bool bus_event() {
+  uint8_t cr = TWCR;
+  if (!(cr & (1<<TWEN)) || !(cr & (1<<TWINT)))
+    return false;
+
+  // the flag reads 0 while the hardware works
+  TWCR = cr & ~(1<<TWINT);
+  uint32_t period = twi_scl_cycles(TWBR, TWSR & ((1<<TWPS1) | (1<<TWPS0)));
+
+  if (cr & (1<<TWSTO)) {
+    release_bus();
+    TWCR &= ~(1<<TWSTO);
+    TWSR = TW_NO_INFO | (TWSR & ((1<<TWPS1) | (1<<TWPS0)));
+    if (advance(period) || !(cr & (1<<TWSTA)))
+      return true;
+  }
+
+  if (cr & (1<<TWSTA)) {
+    uint8_t status = phase == BUS_IDLE ? TW_START : TW_REP_START;
+    end_transfer();
+    phase = BUS_ADDR;
+    sim_stats.starts++;
+
+    if (!advance(period))
+      interrupt(status, TWDR);
+    return true;
+  }
+
+  uint8_t b = TWDR;
+  bool ack;
+
+  switch (phase) {
+    case BUS_ADDR:
+      if (sim_rival != NULL) {
+        rival();
+        return true;
+      }
+
+      dev = find(b >> 1);
+      ack = dev != NULL && !dev->inject_nack() && dev->start(b & 1);
+      if (!ack)
+        dev = NULL;
+      phase = (b & 1) ? BUS_MR : BUS_MT;
+
+      if (!byte_time(ack))
+        interrupt((b & 1) ? (ack ? TW_MR_SLA_ACK : TW_MR_SLA_NACK) :
+                            (ack ? TW_MT_SLA_ACK : TW_MT_SLA_NACK), b);
+      return true;
+
+    case BUS_MT:
+      ack = dev != NULL && !dev->inject_nack() && dev->write(b);
+
+      if (!byte_time(ack))
+        interrupt(ack ? TW_MT_DATA_ACK : TW_MT_DATA_NACK, b);
+      return true;
+
+    case BUS_MR:
+      // the master ACKs with TWEA; nobody drives SDA if the device is gone
+      ack = (cr & (1<<TWEA)) != 0;
+      b = dev != NULL ? dev->read(ack) : 0xFF;
+
+      if (!byte_time(true))
+        interrupt(ack ? TW_MR_DATA_ACK : TW_MR_DATA_NACK, b);
+      return true;
+
+    default:
+      // a byte with no START before it goes nowhere
+      return false;
+  }
+}
+
+// the master has written a STOP that the bus hasn't carried out yet
+static bool stop_pending() {
+  return (TWCR & ((1<<TWEN) | (1<<TWINT) | (1<<TWSTO))) == ((1<<TWEN) | (1<<TWINT) | (1<<TWSTO));
+}
+
+void sim_run(uint64_t until) {
+  // a STOP is carried out even once until has come, as the hardware starts on
+  // it at once: the main loop can't turn it into a repeated START by enqueueing
+  while (now < until || stop_pending()) {
+    for (uint8_t k = 0; k < ndevices; k++)
+      devices[k]->tick(now);
+
+    if (!bus_event())
+      advance(until - now);
+  }
+}
+
+static uint32_t poll_cycles;
+
+// host_poll; a callback run from an interrupt can't wait for the bus
+static void poll() {
+  static bool running;
+
+  if (running)
+    return;
+  running = true;
+  sim_run(now + poll_cycles);
+  running = false;
+}
+
+void sim_blocking(uint32_t cycles) {
+  poll_cycles = cycles;
+  host_poll = cycles ? poll : NULL;
+}
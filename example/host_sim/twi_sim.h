@@ -0,0 +1,112 @@
+#ifndef twi_sim_h
+#define twi_sim_h
+
+#include <stdint.h>
+
+/* A simulated TWI bus for ../../TWIMaster.cpp on a PC.
+
+   The master's TWCR writes are carried out against twiSimDevice models: a write
+   with TWINT set sends a START, an address or data byte, or a STOP, and the
+   status it leads to is put in TWSR (and TWDR) before TWI_vect is called, as the
+   hardware would. Simulated time is counted in CPU clocks at F_CPU; each byte
+   takes 9 SCL periods of TWI_TWBR/TWI_TWPS plus the device's clock stretching,
+   and TWI_TIMER and TWI_STAMP_TIMER count along with it, so timeouts, latency
+   stamps and USINGBUSLOAD behave as on the target.
+
+   Only one master is modelled: there is no arbitration, and the master's own
+   slave address (USINGSLAVE) is never called, unless sim_fault says so or
+   sim_rival brings in a second master.
+*/
+
+class twiSimDevice {
+public:
+  uint8_t addr;           // 7-bit
+  uint32_t stretch;       // CPU clocks SCL is held low after each byte this device takes part in
+  uint16_t nack_permille; // chance of NACKing its address or a byte written to it
+
+  uint32_t nacks_injected;
+  uint32_t bytes;
+
+  twiSimDevice(uint8_t addr_) :
+    addr(addr_), stretch(0), nack_permille(0), nacks_injected(0), bytes(0), rng(addr_ + 1)
+  {}
+  virtual ~twiSimDevice() {}
+
+  // addressed with SLA+R (read) or SLA+W; returns false to NACK
+  virtual bool start(bool read) = 0;
+  // returns false to NACK
+  virtual bool write(uint8_t b) = 0;
+  // the next byte for the master; ack is whether the master ACKs it
+  virtual uint8_t read(bool ack) = 0;
+  // a STOP or repeated START ended the transfer (or a timeout reset the bus)
+  virtual void stop() {}
+  // called with the simulated time before each bus event
+  virtual void tick(uint64_t now) {}
+
+  // true if a NACK should be injected here
+  bool inject_nack();
+
+private:
+  uint32_t rng;
+};
+
+// attach up to TWI_SIM_DEVICES devices to the bus
+#define TWI_SIM_DEVICES 8
+void sim_attach(twiSimDevice *d);
+
+// CPU clocks of target time to charge for each TWI interrupt (the master's ISR,
+// including its callbacks with twiCallbacksInISR); the host runs them in no time
+extern uint32_t sim_isr_cycles;
+
+// carries out the bus events due until the simulated time reaches until (CPU
+// clocks since the start); the time then jumps ahead if the bus is idle
+void sim_run(uint64_t until);
+uint64_t sim_now();
+
+// lets the blocking enqueues work: from then on, twiQ.run_callbacks() called
+// with interrupts enabled, as it is while they wait, runs the bus for cycles
+// CPU clocks (0 turns this off again)
+void sim_blocking(uint32_t cycles);
+
+// fault injection: if set, called with each status about to be put in TWSR; it
+// returns the status to deliver instead, or TWI_SIM_HANG for no interrupt at all
+// (as if a device held SCL low until the timeout). Arbitration lost (0x38), a bus
+// error (0x00) and the slave states release the bus, as they do on the hardware
+#define TWI_SIM_HANG 0xFF
+extern uint8_t (*sim_fault)(uint8_t status);
+
+// A second master, for USINGSLAVE builds: when sim_rival is set, it wins
+// arbitration on the next address byte the master sends (0x68, 0x78 or 0xB0)
+// and addresses it in its place, at TWAR or, if sla is 0, by general call. It
+// writes len bytes of data or, with sla's R/W bit set, reads len bytes into
+// data (NACKing the last), then sends a STOP. These statuses skip sim_fault.
+// sim_rival is cleared as it starts; done counts the bytes the master's slave
+// ACKed or sent, and finished is false if a timeout cut the transfer short.
+typedef struct {
+  uint8_t sla;
+  uint8_t len;
+  uint8_t data[16];
+  uint8_t done;
+  bool finished;
+} twi_sim_rival_t;
+
+extern twi_sim_rival_t *sim_rival;
+
+// a TWI interrupt that returns without clearing TWINT is entered again at once,
+// and the TWI vector outranks the timers'; the simulation gives up after this
+// many, and counts a storm
+#define TWI_SIM_STORM 100
+
+typedef struct {
+  uint64_t busy;       // CPU clocks from a START to its STOP (queued commands follow
+                       // each other with repeated STARTs, so this can be one long stretch)
+  uint32_t starts;     // STARTs and repeated STARTs
+  uint32_t bytes;      // address and data bytes
+  uint32_t nacks;      // NACKed address and data bytes
+  uint32_t timeouts;   // TWI_TIMER_vect calls
+  uint32_t storms;     // TWI interrupts that didn't clear TWINT TWI_SIM_STORM times running
+} twi_sim_stats_t;
+
+extern twi_sim_stats_t sim_stats;
+
+#endif // #ifndef twi_sim_h
@@ -0,0 +1,636 @@
+/* twi_stress: fault injection against ../../TWIMaster.cpp's state machine, on
+   the simulated bus (twi_sim.h).
+
+     ./twi_stress [-t ms] [-f permille] [-w n] [-p us] [-b us] [-i cycles] [-x seed] [-R]
+
+   A main loop keeps up to -w commands outstanding (TWI_QUEUE_SIZE - 1), now and
+   then letting the queue drain, every -p microseconds (50). They are reads and
+   writes of 0 to STRESS_LEN bytes, to a device that ACKs everything and reads
+   back a fixed pattern. -f per mille of the TWI interrupts (50) carry a fault
+   instead of the status the bus would give:
+
+     arb    arbitration lost (0x38) during an address or data byte
+     bus    a bus error (0x00)
+     nack   the NACK status in place of the ACK one
+     slave  arbitration lost and addressed as a slave (0x68, 0x78, 0xB0); with
+            USINGSLAVE, a second master (sim_rival) wins the address byte and
+            addresses this one, whose slave is ../../TWISlaveMem14.c: it writes
+            to or reads from the slave's store, or sends a general call latch
+     hang   no interrupt at all, as if SCL were held low (USINGTIMER only; not
+            while waiting for the bus after losing arbitration, where the master
+            has no timeout by design)
+     raw    with -R, any status from 0x00 to 0xC8, whether or not it could follow
+            (in place of hang, as such a status can leave the master waiting
+            for a START without its timeout, as after losing arbitration)
+
+   and after every -p microseconds the master is checked for
+
+     order    every command's callback exactly once, in the order enqueued
+     index    currCallback() is the oldest outstanding command, currCmd() the
+              first not yet done, and hasCmd() and hasCallback() agree
+     overrun  guard bytes after each command's data intact
+     data     a read reported successful holds the device's pattern, and a
+              write reported successful reached the device whole (not with -R)
+     storm    a TWI interrupt left with TWINT set (see twi_sim.h)
+     recover  a command succeeds within -b microseconds of the last fault (by
+              default, twice the timeout plus two of the longest commands)
+     slave    with USINGSLAVE, each of the second master's transfers went
+              through whole, with the right data, and without TWIUserError
+
+   and, once the faults stop, that the queue drains. It prints the time from a
+   fault to the next successful callback, by kind of fault, as log2 histograms,
+   and the violations; the exit status is 1 if there were any.
+
+   Build with the target's OPTIONS (see the Makefile); -R isn't supported with
+   USINGSLAVE, as statuses out of sequence leave the slave waiting for the end
+   of a transfer that never comes.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <util/twi.h>
+#include "TWIMaster.h"
+#include "twi_sim.h"
+
+#ifdef USINGBUSLOAD
+void TWIBusLoadWarning(uint8_t percent) {}
+#endif
+
+#define US(us) ((uint64_t)(us) * (F_CPU / 1000000))
+
+#define STRESS_LEN 8    // longest command
+#define STRESS_GUARD 8  // guard bytes after each command's data
+#define STRESS_ADDR 0x2A
+
+static uint32_t rng = 1;
+
+static uint32_t rnd() {
+  rng ^= rng << 13;
+  rng ^= rng >> 17;
+  rng ^= rng << 5;
+  return rng;
+}
+
+static uint32_t fnv(const uint8_t *p, uint8_t len) {
+  uint32_t h = 2166136261u;
+  while (len--)
+    h = (h ^ *p++) * 16777619u;
+  return h;
+}
+
+static uint8_t pattern(uint8_t k) {
+  return 0xC3 ^ (k * 7);
+}
+
+
+/* The device
+*/
+
+// ACKs everything; reads give pattern(0), pattern(1), ... from each SLA+R, and
+// the length and hash of the last few write transfers are kept
+class stressDevice : public twiSimDevice {
+public:
+  enum { LOG = 64 };
+
+  stressDevice() : twiSimDevice(STRESS_ADDR), nlog(0), writing(false) {}
+
+  bool start(bool read) {
+    finish();
+    writing = !read;
+    wlen = rpos = 0;
+    whash = 2166136261u;
+    return true;
+  }
+
+  bool write(uint8_t b) {
+    wlen++;
+    whash = (whash ^ b) * 16777619u;
+    return true;
+  }
+
+  uint8_t read(bool ack) {
+    return pattern(rpos++);
+  }
+
+  void stop() {
+    finish();
+  }
+
+  // whether a write of len bytes hashing to hash went through whole lately
+  // (a callback run in the ISR comes before the STOP or repeated START)
+  bool wrote(uint8_t len, uint32_t hash) {
+    if (writing && wlen == len && whash == hash)
+      return true;
+    for (uint8_t k = 0; k < LOG && k < nlog; k++)
+      if (log[k].len == len && log[k].hash == hash)
+        return true;
+    return false;
+  }
+
+private:
+  struct { uint8_t len; uint32_t hash; } log[LOG];
+  uint32_t nlog;
+  bool writing;
+  uint8_t wlen, rpos;
+  uint32_t whash;
+
+  void finish() {
+    if (writing) {
+      log[nlog % LOG].len = wlen;
+      log[nlog % LOG].hash = whash;
+      nlog++;
+    }
+    writing = false;
+  }
+};
+
+static stressDevice dev;
+
+
+/* This master's own slave, for the second master (USINGSLAVE)
+*/
+
+extern "C" {
+void setup(uint8_t addr, uint8_t* bs, int rlen, int wlen);
+void setup_latch(uint8_t *src, uint8_t *dst, uint8_t len);
+void TWIUserError(uint8_t);
+void TWIUserSignal(uint8_t);
+}
+
+static uint32_t slave_errors;
+
+void TWIUserError(uint8_t e) {
+  slave_errors++;
+}
+
+void TWIUserSignal(uint8_t sig) {}
+
+#ifdef USINGSLAVE
+#define STRESS_OWN 0x3C
+#define STRESS_LATCH 0x4C // TWI_GCALL_LATCH in TWISlaveMem14.c
+
+// store[k] == k throughout, as the second master only writes back what is there
+static uint8_t store[256];
+static uint8_t latch_src[4], latch_dst[4];
+static uint16_t slave_i; // the slave's address, as the second master left it (0xFFFF: unknown)
+
+static twi_sim_rival_t rival;
+static bool rival_armed;
+
+// sets the second master up for the master's next address byte
+static void arm_rival() {
+  switch (rnd() % 3) {
+    case 0: { // a Mem14 address and 1 - 8 bytes
+      uint8_t a = rnd() % (sizeof(store) - 8), n = 1 + rnd() % 8;
+      rival.sla = STRESS_OWN << 1;
+      rival.data[0] = a;
+      rival.data[1] = 0;
+      for (uint8_t k = 0; k < n; k++)
+        rival.data[2 + k] = store[a + k];
+      rival.len = 2 + n;
+      break;
+    }
+    case 1: // 1 - 8 bytes from where the last write left off
+      rival.sla = (STRESS_OWN << 1) | 1;
+      rival.len = 1 + rnd() % 8;
+      break;
+    default:
+      for (uint8_t k = 0; k < sizeof(latch_src); k++)
+        latch_src[k] = rnd();
+      rival.sla = 0;
+      rival.data[0] = STRESS_LATCH;
+      rival.len = 1;
+      break;
+  }
+  rival_armed = true;
+  sim_rival = &rival;
+}
+
+// once the second master's transfer is over: did it go through?
+static bool rival_good() {
+  bool good = rival.done == rival.len && slave_errors == 0;
+
+  if (rival.sla == 0)
+    good = good && memcmp(latch_src, latch_dst, sizeof(latch_src)) == 0;
+  else if (rival.sla & 1) {
+    // reads past the end of the store give 0 and leave the address there
+    for (uint8_t k = 0; k < rival.len && slave_i != 0xFFFF; k++) {
+      good = good && rival.data[k] == (slave_i < sizeof(store) ? store[slave_i] : 0);
+      if (slave_i < sizeof(store))
+        slave_i++;
+    }
+  } else
+    slave_i = rival.data[0] + rival.len - 2;
+
+  return good;
+}
+#endif
+
+
+/* Faults
+*/
+
+enum { F_ARB, F_BUS, F_NACK, F_SLAVE, F_HANG, F_RAW, F_KINDS };
+static const char *kind_name[F_KINDS] = { "arb", "bus", "nack", "slave", "hang", "raw" };
+
+#define HIST_BUCKETS 20 // up to 2^19 us
+
+typedef struct {
+  uint32_t injected;
+  uint32_t recovered;
+  uint32_t hist[HIST_BUCKETS]; // microseconds, by log2
+  uint64_t max;
+} fault_stats_t;
+
+static fault_stats_t faults[F_KINDS];
+static uint8_t kinds[F_KINDS], nkinds;
+static uint16_t fault_permille = 50;
+static bool faulting;
+
+static bool pending;             // a fault hasn't been followed by a successful callback
+static uint8_t pending_kind;     // ... the first since the last success
+static uint64_t pending_at;
+static uint64_t last_fault;
+static bool overdue;             // ... and it was counted as unrecovered
+static bool arb_wait;            // the master lost arbitration and waits for the bus
+
+static uint8_t deliver(uint8_t status) {
+  arb_wait = status == TW_MT_ARB_LOST || (status >= TW_SR_SLA_ACK && status <= TW_ST_LAST_DATA);
+  return status;
+}
+
+static uint8_t fault(uint8_t status) {
+  if (!faulting || rnd() % 1000 >= fault_permille)
+    return deliver(status);
+
+  uint8_t kind = kinds[rnd() % nkinds];
+  uint8_t f = status;
+  bool rival_fault = false;
+
+  switch (kind) {
+    case F_ARB:
+      if (status >= TW_MT_SLA_ACK && status <= TW_MR_DATA_NACK)
+        f = TW_MT_ARB_LOST;
+      break;
+    case F_BUS:
+      f = TW_BUS_ERROR;
+      break;
+    case F_NACK:
+      if (status == TW_MT_SLA_ACK || status == TW_MT_DATA_ACK || status == TW_MR_SLA_ACK)
+        f = status + 8;
+      break;
+    case F_SLAVE:
+#ifdef USINGSLAVE
+      // the address byte that follows goes to the second master
+      if ((status == TW_START || status == TW_REP_START) && !rival_armed) {
+        arm_rival();
+        rival_fault = true;
+      }
+#else
+      if (status == TW_MT_SLA_ACK || status == TW_MR_SLA_ACK) {
+        static const uint8_t s[] = { TW_SR_ARB_LOST_SLA_ACK, TW_SR_ARB_LOST_GCALL_ACK, TW_ST_ARB_LOST_SLA_ACK };
+        f = s[rnd() % 3];
+      }
+#endif
+      break;
+    case F_HANG:
+      if (!arb_wait)
+        f = TWI_SIM_HANG;
+      break;
+    case F_RAW:
+      f = (rnd() % 26) * 8;
+      break;
+  }
+  if (f == status && !rival_fault)
+    return deliver(status); // not a fault that could happen here
+
+  faults[kind].injected++;
+  last_fault = sim_now();
+  overdue = false;
+  if (!pending) {
+    pending = true;
+    pending_kind = kind;
+    pending_at = last_fault;
+  }
+  return f == TWI_SIM_HANG ? f : deliver(f);
+}
+
+
+/* Commands
+*/
+
+typedef struct {
+  uint32_t id;
+  bool read;
+  uint8_t len;
+  uint32_t hash; // of a write's data
+} cmd_t;
+
+// commands complete in order, so entry id % TWI_QUEUE_SIZE of each is free
+static cmd_t outstanding[TWI_QUEUE_SIZE];
+static char pool[TWI_QUEUE_SIZE][STRESS_LEN + STRESS_GUARD];
+static uint32_t next_id, head_id; // head_id is the oldest outstanding
+
+typedef struct {
+  uint32_t enqueued, callbacks, ok, failed, timed_out;
+  uint32_t order, index, overrun, data, unrecovered, lost, slave;
+} stress_t;
+
+static stress_t r;
+static bool raw;
+static uint32_t window = TWI_QUEUE_SIZE - 1;
+static uint64_t last_callback;
+
+static uint32_t count() {
+  return next_id - head_id;
+}
+
+static void stress_done(state_t *s) {
+  r.callbacks++;
+  last_callback = sim_now();
+
+  if (count() == 0 || s->buff != pool[head_id % TWI_QUEUE_SIZE]) {
+    r.order++;
+    return;
+  }
+
+  cmd_t &c = outstanding[head_id % TWI_QUEUE_SIZE];
+  const uint8_t *p = (const uint8_t *)s->buff;
+  head_id++;
+
+  for (uint8_t k = c.len; k < c.len + STRESS_GUARD; k++)
+    if (p[k] != 0xEE) {
+      r.overrun++;
+      break;
+    }
+
+  if (s->state & (1<<STATE_TIMEOUT_BIT))
+    r.timed_out++;
+  if (!(s->state & (1<<STATE_SUCCESS_BIT))) {
+    r.failed++;
+    return;
+  }
+  r.ok++;
+
+  if (!raw) {
+    bool good = true;
+    if (c.read)
+      for (uint8_t k = 0; k < c.len; k++)
+        good = good && p[k] == pattern(k);
+    else if (c.len > 0)
+      good = dev.wrote(c.len, c.hash);
+    if (!good)
+      r.data++;
+  }
+
+  if (pending) {
+    uint64_t us = (sim_now() - pending_at) / (F_CPU / 1000000);
+    fault_stats_t &f = faults[pending_kind];
+    uint8_t b = 0;
+    while (b < HIST_BUCKETS - 1 && (1ull << b) < us)
+      b++;
+    f.hist[b]++;
+    f.recovered++;
+    if (us > f.max)
+      f.max = us;
+    pending = false;
+  }
+}
+
+static bool enqueue() {
+  uint8_t slot = next_id % TWI_QUEUE_SIZE;
+  cmd_t &c = outstanding[slot];
+  char *buf = pool[slot];
+
+  c.id = next_id;
+  c.read = rnd() & 1;
+  c.len = rnd() % (STRESS_LEN + 1);
+
+  memset(buf, 0xEE, sizeof(pool[0]));
+  if (c.read)
+    memset(buf, 0x55, c.len);
+  else {
+    for (uint8_t k = 0; k < c.len; k++)
+      buf[k] = k == 0 ? c.id : rnd();
+    c.hash = fnv((const uint8_t *)buf, c.len);
+  }
+
+  // counted first, as a write of 0 bytes is done (and called back) at once
+  next_id++;
+  bool ok = c.read ? twiQ.enqueue_r(STRESS_ADDR, buf, c.len, stress_done) :
+                     twiQ.enqueue_w(STRESS_ADDR, buf, c.len, stress_done);
+  if (ok)
+    r.enqueued++;
+  else
+    next_id--;
+  return ok;
+}
+
+#ifdef USINGSLAVE
+// between slices, once the second master's transfer is over
+static void check_rival() {
+  if (!rival_armed || sim_rival != NULL)
+    return;
+
+  // a timeout cut it short, which proves nothing, but leaves the slave's
+  // address unknown
+  if (!rival.finished)
+    slave_i = 0xFFFF;
+  else if (!rival_good())
+    r.slave++;
+  rival_armed = false;
+  slave_errors = 0;
+}
+#endif
+
+// the queue's indices, as far as the public interface shows them, against the
+// commands outstanding; between interrupts, with no callback running
+static bool check_queue() {
+  uint32_t n = count();
+  uint32_t k = (&twiQ.currCmd() - &twiQ.currCallback() + TWI_QUEUE_SIZE) % TWI_QUEUE_SIZE;
+
+  if (k > n || (k == n) == twiQ.hasCmd() || (k == 0) == twiQ.hasCallback())
+    return false;
+  if (n > 0 && twiQ.currCallback().buff != pool[head_id % TWI_QUEUE_SIZE])
+    return false;
+  if (k < n && twiQ.currCmd().buff != pool[(head_id + k) % TWI_QUEUE_SIZE])
+    return false;
+  return true;
+}
+
+
+static void report(uint64_t cycles, uint64_t bound) {
+  double ms = cycles * 1000.0 / F_CPU;
+  uint32_t total = 0;
+
+  printf("%.1f ms: %u commands, %u callbacks (%u ok, %u failed, %u timed out), "
+         "%u STARTs, %u timeouts\n",
+         ms, r.enqueued, r.callbacks, r.ok, r.failed, r.timed_out,
+         sim_stats.starts, sim_stats.timeouts);
+
+  printf("faults:");
+  for (uint8_t k = 0; k < nkinds; k++) {
+    printf(" %s %u", kind_name[kinds[k]], faults[kinds[k]].injected);
+    total += faults[kinds[k]].injected;
+  }
+  printf(" (%u)\n", total);
+
+  printf("recovery, fault to the next successful callback (us):\n       ");
+  for (uint8_t k = 0; k < nkinds; k++)
+    printf(" %7s", kind_name[kinds[k]]);
+  printf("\n");
+  for (uint8_t b = 0; b < HIST_BUCKETS; b++) {
+    bool any = false;
+    for (uint8_t k = 0; k < nkinds; k++)
+      any = any || faults[kinds[k]].hist[b] != 0;
+    if (!any)
+      continue;
+    printf(b < HIST_BUCKETS - 1 ? "  <= %-3lu" : "   > %-3lu",
+           (unsigned long)(b < HIST_BUCKETS - 1 ? 1ul << b : 1ul << (b - 1)));
+    for (uint8_t k = 0; k < nkinds; k++)
+      printf(" %7u", faults[kinds[k]].hist[b]);
+    printf("\n");
+  }
+  printf("    max ");
+  for (uint8_t k = 0; k < nkinds; k++)
+    printf(" %7lu", (unsigned long)faults[kinds[k]].max);
+  printf("\n");
+
+  printf("violations: %u order, %u index, %u overrun, %u data, %u storm, "
+         "%u unrecovered (> %lu us), %u lost, %u slave\n",
+         r.order, r.index, r.overrun, r.data, sim_stats.storms,
+         r.unrecovered, (unsigned long)(bound / (F_CPU / 1000000)), r.lost, r.slave);
+}
+
+int main(int argc, char **argv) {
+  uint32_t ms = 1000, slice_us = 50, bound_us = 0;
+  int opt;
+
+  sim_isr_cycles = 200;
+
+  while ((opt = getopt(argc, argv, "t:f:w:p:b:i:x:R")) != -1) {
+    switch (opt) {
+      case 't': ms = strtoul(optarg, NULL, 0); break;
+      case 'f': fault_permille = strtoul(optarg, NULL, 0); break;
+      case 'w': window = strtoul(optarg, NULL, 0); break;
+      case 'p': slice_us = strtoul(optarg, NULL, 0); break;
+      case 'b': bound_us = strtoul(optarg, NULL, 0); break;
+      case 'i': sim_isr_cycles = strtoul(optarg, NULL, 0); break;
+      case 'x': rng = strtoul(optarg, NULL, 0); break;
+      case 'R': raw = true; break;
+      default:
+        fprintf(stderr, "usage: %s [-t ms] [-f permille] [-w n] [-p us] [-b us] "
+                        "[-i cycles] [-x seed] [-R]\n", argv[0]);
+        return 2;
+    }
+  }
+#ifdef USINGSLAVE
+  if (raw) {
+    fprintf(stderr, "%s: -R isn't supported with USINGSLAVE\n", argv[0]);
+    return 2;
+  }
+#endif
+  if (window == 0 || window > TWI_QUEUE_SIZE - 1)
+    window = TWI_QUEUE_SIZE - 1;
+  if (slice_us == 0)
+    slice_us = 1;
+  if (rng == 0)
+    rng = 1;
+
+  kinds[nkinds++] = F_ARB;
+  kinds[nkinds++] = F_BUS;
+  kinds[nkinds++] = F_NACK;
+  kinds[nkinds++] = F_SLAVE;
+  if (raw)
+    kinds[nkinds++] = F_RAW;
+#ifdef USINGTIMER
+  else
+    kinds[nkinds++] = F_HANG;
+#endif
+
+  sim_attach(&dev);
+  sim_fault = fault;
+  i2c_master_initialize();
+#ifdef USINGSLAVE
+  for (uint16_t k = 0; k < sizeof(store); k++)
+    store[k] = k;
+  setup(STRESS_OWN, store, sizeof(store), sizeof(store));
+  setup_latch(latch_src, latch_dst, sizeof(latch_src));
+#endif
+  sei();
+
+  // the longest command: SLA and STRESS_LEN bytes (and the byte a read of 0
+  // clocks in), and an interrupt for each, its START and its repeated START
+  uint64_t period = twi_scl_cycles(TWBR, TWSR & ((1<<TWPS1) | (1<<TWPS0)));
+  uint64_t longest = (STRESS_LEN + 2) * (9 * period + sim_isr_cycles) + 2 * period;
+  uint64_t bound = bound_us != 0 ? US(bound_us) : 2 * longest + US(slice_us);
+#ifdef USINGTIMER
+  if (bound_us == 0)
+    bound += 2 * (uint64_t)TWI_TIMEOUT_CYCLES;
+#endif
+
+  printf("SCL %u Hz, %u clocks per TWI interrupt, %u of %u queue entries, "
+         "%u per mille of interrupts faulted%s\n",
+         twi_scl(F_CPU, TWBR, TWSR & 3), sim_isr_cycles, window, TWI_QUEUE_SIZE,
+         fault_permille, raw ? ", raw statuses" : "");
+
+  uint64_t end = US((uint64_t)ms * 1000);
+  bool stalled = false;
+  faulting = true;
+
+  while (sim_now() < end) {
+    // now and then, let the queue drain
+    if (rnd() % 16 != 0)
+      while (count() < window && enqueue())
+        ;
+
+    sim_run(sim_now() + US(slice_us));
+    twiQ.run_callbacks();
+#ifdef USINGSLAVE
+    check_rival();
+#endif
+
+    if (!check_queue()) {
+      r.index++;
+      break; // nothing after this can be trusted
+    }
+
+    uint64_t now = sim_now();
+    if (count() == 0)
+      pending = false; // nothing to recover
+    if (pending && !overdue && now - last_fault > bound) {
+      r.unrecovered++;
+      overdue = true;
+    }
+    if (count() > 0 && now - last_callback > 100 * bound &&
+        (!faulting || now - last_fault > 100 * bound)) {
+      stalled = true;
+      break;
+    }
+  }
+
+  // no more faults: everything outstanding must now complete
+  faulting = false;
+  uint64_t drain = sim_now() + 4 * bound + window * longest;
+  while (!stalled && !r.index && count() > 0 && sim_now() < drain) {
+    sim_run(sim_now() + US(slice_us));
+    twiQ.run_callbacks();
+#ifdef USINGSLAVE
+    check_rival();
+#endif
+  }
+  r.lost = count();
+  if (r.index == 0 && !check_queue())
+    r.index++;
+
+  report(sim_now(), bound);
+  if (stalled)
+    printf("stalled at %.3f ms: %u commands outstanding, the last callback at %.3f ms\n",
+           sim_now() * 1000.0 / F_CPU, count(), last_callback * 1000.0 / F_CPU);
+
+  bool bad = r.order || r.index || r.overrun || r.data || sim_stats.storms ||
+             r.unrecovered || r.lost || r.slave;
+  return bad ? 1 : 0;
+}
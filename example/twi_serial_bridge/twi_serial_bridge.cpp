@@ -1,5 +1,6 @@
 #include "Arduino.h"
 #include "TWIMaster.h"
+#include "TWIHelper.h"
 #include "string_parse.h"
 #include "SerialPrinter.h"
 
@@ -14,9 +15,11 @@ Alter the #defines below to suit your device.
 #define DEFAULT_TWI_ADDRESS 0x50
 #define LEDPIN 13 // this is an LED on Arduino boards
 const uint8_t MAXCOUNT = 0x20; // max # of bytes to read/write to TWI
+const uint8_t MAXDEVICES = 0x20; // max # of TWI devices assigned addresses by 'n'
+#define DEFAULT_FIRST_ADDRESS 0x10 // first address handed out by 'n'
 
-// we're using the fact that the low two bits of TWSR are 0 because 
-// ../../TWIMaster.h does not use TWPS[1:0]
+// we're using the fact that the low two bits of .state are free because
+// ../../TWIMaster.cpp masks TWPS[1:0] out of TWSR
 #define TWI_TIMEOUT (1<<(STATE_SUCCESS_BIT+1))
 #define ACK_CHAR '~'
 
@@ -141,6 +144,81 @@ void twi_w(uint16_t mem_addr, uint8_t* write, uint8_t count) {
     usb.print(ACK_CHAR);
 }
 
+#ifdef USINGLATENCY
+void print_latency_row(const char *name, const uint16_t *h) {
+  usb.print(name);
+  for (uint8_t b = 0; b < TWI_LATENCY_BUCKETS; b++) {
+    usb.print(" ");
+    usb.print_hex(h[b]);
+  }
+  usb.println();
+}
+
+void print_latency() {
+  twi_latency_t l;
+  twi_latency_snapshot(&l);
+
+  usb.print("addr ");
+  usb.print_hex(l.addr);
+  usb.println();
+  print_latency_row("queued", l.queued);
+  print_latency_row("wire", l.wire);
+  print_latency_row("total", l.total);
+}
+#endif
+
+#ifdef USINGBUSLOAD
+volatile uint8_t _busload_warning = 0;
+
+void TWIBusLoadWarning(uint8_t percent) {
+  // printing from the ISR would take far too long
+  _busload_warning = percent;
+}
+
+void print_busload() {
+  twi_busload_t u;
+  twi_busload_snapshot(&u);
+
+  usb.print("busy ");
+  usb.print(u.busy);
+  usb.print(" idle ");
+  usb.print(u.idle);
+  usb.print(" ");
+  usb.print(u.percent);
+  usb.println("%");
+}
+#endif
+
+#ifdef USINGRECORD
+// one line per record, oldest first: code data len t, in hexadecimal; this is
+// the format read by ../host_sim/twi_replay
+void print_record_line(const twi_record_t *r) {
+  usb.print_hex8(r->code);
+  usb.print(" ");
+  usb.print_hex8(r->data);
+  usb.print(" ");
+  usb.print_hex8(r->len);
+  usb.print(" ");
+  usb.print_hex8(r->t >> 8);
+  usb.print_hex8(r->t & 0xFF);
+  usb.println();
+}
+
+void print_record() {
+  // the ring is frozen while it is printed, which takes a while
+  twiTraceRecord::paused = true;
+
+  uint8_t head = twiTraceRecord::head;
+  if (twiTraceRecord::wrapped)
+    for (uint8_t i = head; i < TWI_RECORD_LEN; i++)
+      print_record_line(&twiTraceRecord::ring[i]);
+  for (uint8_t i = 0; i < head; i++)
+    print_record_line(&twiTraceRecord::ring[i]);
+
+  twiTraceRecord::paused = false;
+}
+#endif
+
 bool test_twi_addr(uint8_t addr) {
   // must read/write at least one byte
   char c;
@@ -212,6 +290,15 @@ void loop() {
   const uint8_t MAXSIZE = 0x80;
   char buffer[MAXSIZE];
   
+#ifdef USINGBUSLOAD
+  if (_busload_warning) {
+    usb.print("WARNING: TWI bus utilisation ");
+    usb.print(_busload_warning);
+    usb.println("%");
+    _busload_warning = 0;
+  }
+#endif
+
   if (usb.read_line(buffer, MAXSIZE, 0, true) == SerialPrinter::Success) {
     char *p = buffer; // this pointer will get modified as things are parsed
     
@@ -222,6 +309,36 @@ void loop() {
           usb.println();
         }
       }
+    } else if (consume_char_if(p, 'n')) {
+      twi_device_t table[MAXDEVICES];
+      uint8_t first = *p != '\0' ? parse_hex8(p) : DEFAULT_FIRST_ADDRESS;
+      uint8_t n = twi_arp_enumerate(first, table, MAXDEVICES);
+
+      for (uint8_t k = 0; k < n; k++) {
+        usb.print_hex(table[k].addr);
+        usb.print(" ");
+        for (uint8_t b = 0; b < TWI_UID_LEN; b++)
+          usb.print_hex8(table[k].uid[b]);
+        usb.println();
+      }
+#ifdef USINGLATENCY
+    } else if (consume_char_if(p, 'l')) {
+      print_latency();
+    } else if (consume_char_if(p, 'L')) {
+      twi_latency_clear(*p != '\0' ? parse_hex8(p) : 0xFF);
+#endif
+#ifdef USINGBUSLOAD
+    } else if (consume_char_if(p, 'u')) {
+      print_busload();
+    } else if (consume_char_if(p, 'U')) {
+      twi_busload_clear();
+#endif
+#ifdef USINGRECORD
+    } else if (consume_char_if(p, 'r')) {
+      print_record();
+    } else if (consume_char_if(p, 'R')) {
+      twiTraceRecord::clear();
+#endif
     } else if (consume_char_if(p, '-')) {
       while (*p != '\0') {
         switch (*p++) {
@@ -245,10 +362,10 @@ void loop() {
             usb.println();
             break;
           case 'o':
-            OCR5A = parse_hex16(p);
+            twiTimerRegs<TWI_TIMER>::ocra() = parse_hex16(p);
 
-            usb.print("Changing OCR5A to 0x");
-            usb.print_hex(OCR5A);
+            usb.print("Changing the timeout OCRnA to 0x");
+            usb.print_hex(twiTimerRegs<TWI_TIMER>::ocra());
             usb.println();
             break;
           default: